@@ -8,8 +8,27 @@
 #include <savvy/writer.hpp>
 
 #include <getopt.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <zstd.h>
+#include <cctype>
+#include <cerrno>
 #include <cstdlib>
 #include <cmath>
+#include <cstring>
+#include <cstdio>
+#include <limits>
+#include <memory>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <thread>
 
 std::vector<std::string> split_string_to_vector(const char* in, char delim)
 {
@@ -27,16 +46,148 @@ std::vector<std::string> split_string_to_vector(const char* in, char delim)
   return ret;
 }
 
+std::uint64_t fnv1a_hash(const void* data, std::size_t size, std::uint64_t hash = 0xcbf29ce484222325ULL)
+{
+  const unsigned char* p = static_cast<const unsigned char*>(data);
+  for (std::size_t i = 0; i < size; ++i)
+    hash = (hash ^ p[i]) * 0x100000001b3ULL;
+  return hash;
+}
+
+// Returns the value of a key in a structured header line (e.g., <ID=PL,Number=G,Type=Integer,...>).
+std::string header_attribute(const std::string& header_value, const std::string& key)
+{
+  std::size_t pos = 0;
+  while ((pos = header_value.find(key + "=", pos)) != std::string::npos)
+  {
+    if (pos > 0 && (header_value[pos - 1] == '<' || header_value[pos - 1] == ','))
+    {
+      std::size_t beg = pos + key.size() + 1;
+      std::size_t end = header_value.find_first_of(",>", beg);
+      return header_value.substr(beg, end == std::string::npos ? std::string::npos : end - beg);
+    }
+    pos += key.size();
+  }
+  return "";
+}
+
+struct genotype_field
+{
+  std::string id;
+  bool is_float;
+};
+
+// FORMAT fields with one value per genotype (Number=G), whose cardinality depends on ploidy.
+std::vector<genotype_field> genotype_fields(const std::vector<std::pair<std::string, std::string>>& headers)
+{
+  std::vector<genotype_field> ret;
+  for (auto it = headers.begin(); it != headers.end(); ++it)
+  {
+    if (it->first != "FORMAT" || header_attribute(it->second, "Number") != "G")
+      continue;
+
+    std::string type = header_attribute(it->second, "Type");
+    if (type == "Integer" || type == "Float")
+      ret.push_back({header_attribute(it->second, "ID"), type == "Float"});
+  }
+  return ret;
+}
+
+// Parses a byte count with an optional K, M or G suffix. Returns 0 if malformed.
+std::size_t parse_size(const char* in)
+{
+  char* end = nullptr;
+  unsigned long long ret = std::strtoull(in, &end, 10);
+  if (end == in)
+    return 0;
+
+  const char* suffixes = "KMG";
+  const char* suffix = *end ? std::strchr(suffixes, std::toupper(static_cast<unsigned char>(*end))) : nullptr;
+  if (suffix)
+  {
+    ret <<= 10 * (suffix - suffixes + 1);
+    ++end;
+  }
+
+  return *end == '\0' ? std::size_t(ret) : 0;
+}
+
+struct output_spec
+{
+  std::string path;
+  savvy::file::format format;
+  int compression_level;
+};
+
 class prog_args
 {
 private:
+  // Codes of options without a short form, above any character getopt_long returns.
+  enum long_only_option
+  {
+    opt_async_output = 256,
+    opt_checkpoint,
+    opt_direct_io,
+    opt_genome,
+    opt_haploid_only,
+    opt_incremental,
+    opt_infer_sex,
+    opt_infer_sex_output,
+    opt_infer_sex_records,
+    opt_infer_sex_thresholds,
+    opt_pipe_size,
+    opt_ploidy_file,
+    opt_preallocate,
+    opt_resume,
+    opt_samples,
+    opt_samples_file,
+    opt_sex_map_cache,
+    opt_split_by_contig,
+    opt_split_ploidy,
+    opt_split_regions,
+    opt_verbose,
+    opt_write_buffer_size
+  };
+
   std::vector<option> long_options_;
   std::string input_path_;
   std::string output_path_ = "/dev/stdout";
   std::string sex_map_path_;
+  std::string sex_map_cache_path_;
+  std::string infer_sex_output_path_;
+  std::string ploidy_file_path_;
+  std::string genome_;
+  std::string samples_file_path_;
+  std::vector<std::string> samples_;
+  std::string split_regions_path_;
   std::string haploid_code_ = "0";
+  std::vector<std::string> pbwt_fields_;
   savvy::file::format output_format_ = savvy::file::format::sav;
   int compression_level_ = 6;
+  std::vector<output_spec> outputs_;
+  int block_size_ = 0;
+  float sparse_threshold_ = 0.3f;
+  std::size_t write_buffer_size_ = std::size_t(4) << 20;
+  bool write_buffer_size_set_ = false;
+  std::size_t pipe_size_ = 0;
+  std::size_t checkpoint_interval_ = 0;
+  std::size_t infer_sex_records_ = 20000;
+  float infer_sex_female_max_ = 0.2f;
+  float infer_sex_male_min_ = 0.8f;
+  std::size_t preallocate_size_ = 0;
+  bool preallocate_auto_ = false;
+  bool async_output_ = false;
+  bool direct_io_ = false;
+  bool split_by_contig_ = false;
+  bool split_ploidy_ = false;
+  bool index_ = false;
+  bool resume_ = false;
+  bool incremental_ = false;
+  bool infer_sex_ = false;
+  bool haploid_code_set_ = false;
+  bool haploid_only_ = false;
+  bool update_ds_ = false;
+  bool verbose_ = false;
   bool verify_ = false;
   bool help_ = false;
   bool version_ = false;
@@ -44,13 +195,40 @@ public:
   prog_args() :
     long_options_(
       {
+        {"async-output", no_argument, 0, opt_async_output},
+        {"block-size", required_argument, 0, 'b'},
+        {"checkpoint", required_argument, 0, opt_checkpoint},
+        {"direct-io", no_argument, 0, opt_direct_io},
+        {"genome", required_argument, 0, opt_genome},
         {"haploid-code", required_argument, 0, 'c'},
+        {"haploid-only", no_argument, 0, opt_haploid_only},
         {"help", no_argument, 0, 'h'},
+        {"incremental", no_argument, 0, opt_incremental},
+        {"index", no_argument, 0, 'x'},
+        {"infer-sex", no_argument, 0, opt_infer_sex},
+        {"infer-sex-output", required_argument, 0, opt_infer_sex_output},
+        {"infer-sex-records", required_argument, 0, opt_infer_sex_records},
+        {"infer-sex-thresholds", required_argument, 0, opt_infer_sex_thresholds},
         {"output", required_argument, 0, 'o'},
         {"output-format", required_argument, 0, 'O'},
+        {"pbwt-fields", required_argument, 0, 'p'},
+        {"pipe-size", required_argument, 0, opt_pipe_size},
+        {"ploidy-file", required_argument, 0, opt_ploidy_file},
+        {"preallocate", required_argument, 0, opt_preallocate},
+        {"resume", no_argument, 0, opt_resume},
+        {"samples", required_argument, 0, opt_samples},
+        {"samples-file", required_argument, 0, opt_samples_file},
         {"sex-map", required_argument, 0, 'm'},
+        {"sex-map-cache", required_argument, 0, opt_sex_map_cache},
+        {"sparse-threshold", required_argument, 0, 's'},
+        {"split-by-contig", no_argument, 0, opt_split_by_contig},
+        {"split-ploidy", no_argument, 0, opt_split_ploidy},
+        {"split-regions", required_argument, 0, opt_split_regions},
+        {"update-ds", no_argument, 0, 'd'},
+        {"verbose", no_argument, 0, opt_verbose},
         {"version", no_argument, 0, 'v'},
         {"verify", no_argument, 0, 'V'},
+        {"write-buffer-size", required_argument, 0, opt_write_buffer_size},
         {0, 0, 0, 0}
       })
   {
@@ -59,76 +237,238 @@ public:
   const std::string& input_path() const { return input_path_; }
   const std::string& output_path() const { return output_path_; }
   const std::string& sex_map_path() const { return sex_map_path_; }
-  const std::string& haploid_code() const { return haploid_code_; }
+  const std::string& sex_map_cache_path() const { return sex_map_cache_path_; }
+  bool infer_sex() const { return infer_sex_; }
+  const std::string& infer_sex_output_path() const { return infer_sex_output_path_; }
+  std::size_t infer_sex_records() const { return infer_sex_records_; }
+  float infer_sex_female_max() const { return infer_sex_female_max_; }
+  float infer_sex_male_min() const { return infer_sex_male_min_; }
+  const std::string& split_regions_path() const { return split_regions_path_; }
+  const std::string& ploidy_file_path() const { return ploidy_file_path_; }
+  const std::string& genome() const { return genome_; }
+  const std::vector<std::string>& samples() const { return samples_; }
+  const std::string& samples_file_path() const { return samples_file_path_; }
+  bool subset_samples() const { return samples_.size() || samples_file_path_.size(); }
+  bool haploid_only() const { return haploid_only_; }
+  bool split_by_contig() const { return split_by_contig_; }
+  bool split_ploidy() const { return split_ploidy_; }
+  // PLINK files code males as 1, so the default differs when the sex map is a .fam or .psam file.
+  std::string haploid_code(bool plink_sex_map = false) const { return haploid_code_set_ || !plink_sex_map ? haploid_code_ : "1"; }
   savvy::file::format output_format() const { return output_format_; }
   int compression_level() const { return compression_level_; }
+  const std::vector<output_spec>& outputs() const { return outputs_; }
+  bool has_sav_output() const
+  {
+    for (auto it = outputs_.begin(); it != outputs_.end(); ++it)
+    {
+      if (it->format == savvy::file::format::sav)
+        return true;
+    }
+    return false;
+  }
+  int block_size() const { return block_size_; }
+  float sparse_threshold() const { return has_sav_output() ? sparse_threshold_ : 0.f; }
+  const std::vector<std::string>& pbwt_fields() const { return pbwt_fields_; }
   bool help_is_set() const { return help_; }
   bool version_is_set() const { return version_; }
   bool verify() const { return verify_; }
+  bool update_ds() const { return update_ds_; }
+  bool index() const { return index_; }
+  std::string index_path(const output_spec& out) const { return index_ && out.format == savvy::file::format::sav ? out.path + ".s1r" : ""; }
+  bool async_output() const { return async_output_; }
+  bool direct_io() const { return direct_io_; }
+  // Preallocation size, estimated from the input size with --preallocate auto.
+  std::size_t preallocate_size() const
+  {
+    struct stat st;
+    if (preallocate_auto_)
+      return stat(input_path_.c_str(), &st) == 0 && S_ISREG(st.st_mode) ? std::size_t(st.st_size) : 0;
+    return preallocate_size_;
+  }
+  bool verbose() const { return verbose_; }
+  std::size_t write_buffer_size() const { return write_buffer_size_; }
+  std::size_t pipe_size() const { return pipe_size_; }
+  std::size_t checkpoint_interval() const { return checkpoint_interval_; }
+  bool resume() const { return resume_; }
+  std::string checkpoint_path() const { return output_path_ + ".ckpt"; }
+  bool incremental() const { return incremental_; }
+  std::string state_path() const { return output_path_ + ".state"; }
 
   void print_usage(std::ostream& os)
   {
     os << "Usage: di2hap [opts ...] input_file.{bcf,sav,vcf.gz} \n";
     os << "\n";
-    os << " -c, --haploid-code   Code used for haploid samples in sex map (default: 0)\n";
-    os << " -h, --help           Print usage\n";
-    os << " -o, --output         Output path (default: /dev/stdout)\n";
-    os << " -O, --output-format  Output file format (vcf, vcf.gz, bcf, ubcf, sav, usav; default: vcf)\n";
-    os << " -m, --sex-map        Sex map file path (default: all samples are presumed haploid)\n";
-    os << " -v, --version        Print version\n";
-    os << " -V, --verify        Verify genotypes are homozygous before converting\n";
+    os << "     --async-output          Write output from background threads with several buffer writes in flight\n";
+    os << " -b, --block-size            Number of records per SAV compression block (default: savvy's block size)\n";
+    os << "     --checkpoint            Write <output>.ckpt every N records so that an interrupted run can be resumed\n";
+    os << " -c, --haploid-code          Code used for haploid samples in sex map (default: 0, or 1 for PLINK files)\n";
+    os << "     --direct-io             Write regular output files with O_DIRECT, bypassing the page cache (implies --async-output)\n";
+    os << "     --genome                Apply built-in PAR, chrY and MT ploidy rules for GRCh37 or GRCh38 (combined with --ploidy-file, which takes precedence)\n";
+    os << " -d, --update-ds             Recompute DS of haploid samples from HDS\n";
+    os << "     --haploid-only          Write only haploid samples, with compacted GT\n";
+    os << " -h, --help                  Print usage\n";
+    os << "     --incremental           Convert only input records past those recorded in <output>.state and append them to the output (no --index)\n";
+    os << " -x, --index                 Write an S1R index (<output>.s1r) while writing SAV output (with --checkpoint or --resume, the finished output is re-encoded once to index it)\n";
+    os << "     --infer-sex             Infer haploid samples from chrX heterozygosity instead of a sex map (requires an indexed input)\n";
+    os << "     --infer-sex-output      Write inferred sexes to TSV file (ID, SEX, F, N_SITES)\n";
+    os << "     --infer-sex-records     Number of non-PAR chrX records sampled by --infer-sex (default: 20000)\n";
+    os << "     --infer-sex-thresholds  Inbreeding coefficient thresholds for female and male calls (default: 0.2,0.8)\n";
+    os << " -o, --output                Output path (default: /dev/stdout; may be repeated to write several outputs)\n";
+    os << " -O, --output-format         Output file format (vcf, vcf.gz, bcf, ubcf, sav, usav; default: vcf; the nth applies to the nth --output)\n";
+    os << " -m, --sex-map               Sex map file path: two-column TSV, PLINK .fam or .psam (default: all samples are presumed haploid)\n";
+    os << "     --resume                Resume an interrupted run from <output>.ckpt (requires an indexed input)\n";
+    os << "     --samples               Comma separated list of samples to convert and write (default: all samples)\n";
+    os << "     --samples-file          File of samples to convert and write, one per line\n";
+    os << "     --sex-map-cache         Binary cache of the resolved sex map, reused while samples, sex map and haploid code are unchanged\n";
+    os << " -p, --pbwt-fields           Comma separated list of FORMAT fields to PBWT sort in SAV output (e.g., GT,HDS)\n";
+    os << "     --pipe-size             Capacity to request for stdin/stdout and internal pipes (e.g., 1M; default: system default)\n";
+    os << "     --ploidy-file           Ploidy rules (CHROM FROM TO SEX PLOIDY; M selects haploid-coded samples, F the others; ploidy 0 sets genotypes to missing; * * * SEX PLOIDY sets a default)\n";
+    os << "     --preallocate           Reserve output disk space up front: a size (e.g., 200G) or auto for the input size (implies --async-output)\n";
+    os << " -s, --sparse-threshold      Non-zero fraction below which converted GT/HDS are stored sparse in SAV output (default: 0.3)\n";
+    os << "     --split-by-contig       Write one output per contig to <output>.<contig>.<ext>\n";
+    os << "     --split-ploidy          Write haploid samples (compacted GT) to <output>.haploid.<ext> and diploid samples to <output>.diploid.<ext>\n";
+    os << "     --split-regions         Write one output per region name in BED file (chrom, start, end[, name]) to <output>.<name>.<ext> (input sorted by position)\n";
+    os << "     --verbose               Print I/O settings in effect\n";
+    os << " -v, --version               Print version\n";
+    os << " -V, --verify                Verify genotypes are homozygous before converting\n";
+    os << "     --write-buffer-size     Size of each of the eight buffers used with --async-output (default: 4M)\n";
     os << std::flush;
   }
 
   bool parse(int argc, char** argv)
   {
+    std::vector<std::string> output_paths;
+    std::vector<std::pair<savvy::file::format, int>> output_formats;
     int long_index = 0;
     int opt = 0;
-    while ((opt = getopt_long(argc, argv, "c:hm:o:O:vV", long_options_.data(), &long_index)) != -1)
+    while ((opt = getopt_long(argc, argv, "b:c:dhm:o:O:p:s:vVx", long_options_.data(), &long_index)) != -1)
     {
-      char copt = char(opt & 0xFF);
-      switch (copt)
+      switch (opt)
+      {
+      case opt_async_output:
+        async_output_ = true;
+        break;
+      case opt_checkpoint:
+        checkpoint_interval_ = std::strtoull(optarg ? optarg : "", nullptr, 10);
+        if (!checkpoint_interval_)
+          return std::cerr << "Error: invalid --checkpoint\n", false;
+        break;
+      case opt_direct_io:
+        direct_io_ = true;
+        async_output_ = true;
+        break;
+      case opt_genome:
+        genome_ = optarg ? optarg : "";
+        if (genome_ != "GRCh37" && genome_ != "GRCh38")
+          return std::cerr << "Error: --genome must be GRCh37 or GRCh38\n", false;
+        break;
+      case opt_haploid_only:
+        haploid_only_ = true;
+        break;
+      case opt_incremental:
+        incremental_ = true;
+        break;
+      case opt_infer_sex:
+        infer_sex_ = true;
+        break;
+      case opt_infer_sex_output:
+        infer_sex_output_path_ = optarg ? optarg : "";
+        break;
+      case opt_infer_sex_records:
+        infer_sex_records_ = std::strtoull(optarg ? optarg : "", nullptr, 10);
+        if (!infer_sex_records_)
+          return std::cerr << "Error: invalid --infer-sex-records\n", false;
+        break;
+      case opt_infer_sex_thresholds:
+      {
+        std::vector<std::string> thresholds = split_string_to_vector(optarg ? optarg : "", ',');
+        if (thresholds.size() != 2)
+          return std::cerr << "Error: --infer-sex-thresholds must be two comma separated values\n", false;
+        infer_sex_female_max_ = float(std::atof(thresholds[0].c_str()));
+        infer_sex_male_min_ = float(std::atof(thresholds[1].c_str()));
+        if (infer_sex_female_max_ > infer_sex_male_min_)
+          return std::cerr << "Error: female threshold of --infer-sex-thresholds exceeds male threshold\n", false;
+        break;
+      }
+      case opt_pipe_size:
+        if (!(pipe_size_ = parse_size(optarg ? optarg : "")))
+          return std::cerr << "Error: invalid --pipe-size\n", false;
+        break;
+      case opt_ploidy_file:
+        ploidy_file_path_ = optarg ? optarg : "";
+        break;
+      case opt_preallocate:
       {
+        std::string val = optarg ? optarg : "";
+        preallocate_auto_ = val == "auto";
+        if (!preallocate_auto_ && !(preallocate_size_ = parse_size(val.c_str())))
+          return std::cerr << "Error: invalid --preallocate\n", false;
+        async_output_ = true;
+        break;
+      }
+      case opt_resume:
+        resume_ = true;
+        break;
+      case opt_samples:
+        samples_ = split_string_to_vector(optarg ? optarg : "", ',');
+        break;
+      case opt_samples_file:
+        samples_file_path_ = optarg ? optarg : "";
+        break;
+      case opt_sex_map_cache:
+        sex_map_cache_path_ = optarg ? optarg : "";
+        break;
+      case opt_split_by_contig:
+        split_by_contig_ = true;
+        break;
+      case opt_split_ploidy:
+        split_ploidy_ = true;
+        break;
+      case opt_split_regions:
+        split_regions_path_ = optarg ? optarg : "";
+        break;
+      case opt_verbose:
+        verbose_ = true;
+        break;
+      case opt_write_buffer_size:
+        if (!(write_buffer_size_ = parse_size(optarg ? optarg : "")))
+          return std::cerr << "Error: invalid --write-buffer-size\n", false;
+        write_buffer_size_set_ = true;
+        break;
+      case 'b':
+        block_size_ = std::atoi(optarg ? optarg : "");
+        if (block_size_ < 1 || block_size_ > 0xFFFF)
+          return std::cerr << "Error: --block-size must be between 1 and 65535\n", false;
+        break;
       case 'c':
         haploid_code_ = optarg ? optarg : "";
+        haploid_code_set_ = true;
+        break;
+      case 'd':
+        update_ds_ = true;
         break;
       case 'h':
         help_ = true;
         return true;
       case 'o':
-        output_path_ = optarg ? optarg : "";
+        output_paths.emplace_back(optarg ? optarg : "");
         break;
       case 'O':
       {
         using fmt = savvy::file::format;
         std::string ot = optarg ? optarg : "";
         if (ot == "vcf")
-        {
-          output_format_ = fmt::vcf;
-          compression_level_ = 0;
-        }
+          output_formats.emplace_back(fmt::vcf, 0);
         else if (ot == "vcf.gz")
-        {
-          output_format_ = fmt::vcf;
-        }
+          output_formats.emplace_back(fmt::vcf, 6);
         else if (ot == "bcf")
-        {
-          output_format_ = fmt::bcf;
-        }
+          output_formats.emplace_back(fmt::bcf, 6);
         else if (ot == "ubcf")
-        {
-          output_format_ = fmt::bcf;
-          compression_level_ = 0;
-        }
+          output_formats.emplace_back(fmt::bcf, 0);
         else if (ot == "sav")
-        {
-          output_format_ = fmt::sav;
-        }
+          output_formats.emplace_back(fmt::sav, 6);
         else if (ot == "usav")
-        {
-          output_format_ = fmt::sav;
-          compression_level_ = 0;
-        }
+          output_formats.emplace_back(fmt::sav, 0);
         else
         {
           std::cerr << "Invalid --output-format: " << ot << std::endl;
@@ -139,12 +479,23 @@ public:
       case 'm':
         sex_map_path_ = optarg ? optarg : "";
         break;
+      case 'p':
+        pbwt_fields_ = split_string_to_vector(optarg ? optarg : "", ',');
+        break;
+      case 's':
+        sparse_threshold_ = float(std::atof(optarg ? optarg : ""));
+        if (sparse_threshold_ < 0.f || sparse_threshold_ > 1.f)
+          return std::cerr << "Error: --sparse-threshold must be between 0 and 1\n", false;
+        break;
       case 'v':
         version_ = true;
         return true;
       case 'V':
         verify_ = true;
         break;
+      case 'x':
+        index_ = true;
+        break;
       default:
         return false;
       }
@@ -165,139 +516,2729 @@ public:
       return std::cerr << "Error: invalid number of arguments\n", false;
     }
 
+    // The nth --output-format applies to the nth --output, and the last one given applies to any remaining outputs.
+    if (output_paths.empty())
+      output_paths.emplace_back(output_path_);
+    if (output_formats.size() > output_paths.size())
+      return std::cerr << "Error: more --output-format than --output options\n", false;
+    for (std::size_t i = 0; i < output_paths.size(); ++i)
+    {
+      output_spec out = {output_paths[i], output_format_, compression_level_};
+      if (output_formats.size())
+      {
+        out.format = output_formats[std::min(i, output_formats.size() - 1)].first;
+        out.compression_level = output_formats[std::min(i, output_formats.size() - 1)].second;
+      }
+      outputs_.push_back(out);
+    }
+    output_path_ = outputs_[0].path;
+    output_format_ = outputs_[0].format;
+    compression_level_ = outputs_[0].compression_level;
+
+    if (outputs_.size() > 1)
+    {
+      if (split_by_contig_ || split_regions_path_.size() || split_ploidy_ || async_output_)
+        return std::cerr << "Error: multiple outputs cannot be combined with split output or --async-output\n", false;
+      for (auto it = outputs_.begin(); it != outputs_.end(); ++it)
+      {
+        if (it->path == "/dev/stdout" && it != outputs_.begin())
+          return std::cerr << "Error: only the first --output may be stdout\n", false;
+      }
+    }
+
+    if (split_by_contig_ || split_regions_path_.size() || split_ploidy_)
+    {
+      if (int(split_by_contig_) + int(split_regions_path_.size() > 0) + int(split_ploidy_) > 1)
+        return std::cerr << "Error: --split-by-contig, --split-regions and --split-ploidy are mutually exclusive\n", false;
+      if (output_path_ == "/dev/stdout")
+        return std::cerr << "Error: split output requires --output to be a path prefix\n", false;
+      if (async_output_)
+        return std::cerr << "Error: split output cannot be combined with --async-output\n", false;
+    }
+
+    if (checkpoint_interval_ || resume_ || incremental_)
+    {
+      if (outputs_.size() > 1 || split_by_contig_ || split_regions_path_.size() || split_ploidy_)
+        return std::cerr << "Error: --checkpoint, --resume and --incremental require a single output\n", false;
+      if (output_path_ == "/dev/stdout")
+        return std::cerr << "Error: --checkpoint, --resume and --incremental require --output to be a file path\n", false;
+      if (resume_ && incremental_)
+        return std::cerr << "Error: --resume cannot be combined with --incremental\n", false;
+      // The output is written by segmented_output rather than through a pipe to async_output.
+      if (async_output_)
+        return std::cerr << "Error: --checkpoint, --resume and --incremental cannot be combined with --async-output\n", false;
+      // savvy cannot extend an existing S1R index, and rebuilding it would re-encode the whole output on every run.
+      if (incremental_ && index_)
+        return std::cerr << "Error: --incremental cannot be combined with --index\n", false;
+    }
+
+    if (index_)
+    {
+      // savvy only builds indexes for SAV, and records file offsets that are not available through a pipe.
+      if (!has_sav_output())
+        return std::cerr << "Error: --index is only supported for SAV output (use bcftools index for BCF and VCF)\n", false;
+      if (output_path_ == "/dev/stdout" && output_format_ == savvy::file::format::sav)
+        return std::cerr << "Error: --index requires --output to be a file path\n", false;
+      if (async_output_)
+        return std::cerr << "Error: --index cannot be combined with --async-output\n", false;
+    }
+
+    // Every written sample is haploid at every position, which region-based ploidy would contradict.
+    if (haploid_only_ && (ploidy_file_path_.size() || genome_.size() || split_ploidy_))
+      return std::cerr << "Error: --haploid-only cannot be combined with --ploidy-file, --genome or --split-ploidy\n", false;
+
+    if (samples_.size() && samples_file_path_.size())
+      return std::cerr << "Error: --samples and --samples-file are mutually exclusive\n", false;
+
+    if ((ploidy_file_path_.size() || genome_.size()) && split_ploidy_)
+      return std::cerr << "Error: --ploidy-file and --genome cannot be combined with --split-ploidy\n", false;
+
+    if (infer_sex_)
+    {
+      if (sex_map_path_.size())
+        return std::cerr << "Error: --infer-sex cannot be combined with --sex-map\n", false;
+      if (input_path_ == "/dev/stdin")
+        return std::cerr << "Error: --infer-sex requires an input file path\n", false;
+    }
+
+    if (!has_sav_output() && (block_size_ || pbwt_fields_.size()))
+      std::cerr << "Warning: --block-size and --pbwt-fields only apply to SAV output" << std::endl;
+
+    if (write_buffer_size_set_ && !async_output_)
+      std::cerr << "Warning: --write-buffer-size only applies with --async-output" << std::endl;
+
     return true;
   }
 };
 
 typedef std::int8_t gt_type;
 
-bool verify(const std::vector<gt_type>& gt, const std::vector<int>& sex_map, const savvy::variant& rec, const std::vector<std::string>& sample_ids)
+// Progress of a conversion, written periodically so that an interrupted run can be resumed.
+struct checkpoint
 {
-  std::size_t stride = gt.size() / sex_map.size();
-  for (std::size_t i = 0; i < sex_map.size(); ++i)
+  std::string chrom;
+  std::uint64_t pos = 0;
+  std::size_t record_count = 0;
+  std::size_t unchanged_count = 0;
+  std::size_t same_pos_count = 0; // records at pos, which is shared by several records when multiallelics are split
+  std::uint64_t offset = 0; // output size after the last record, or 0 if not recorded
+  std::vector<std::string> contigs; // in the order they were converted, which need not be the header's order
+  std::string key; // identifies the sample list and resolved sex map the output was produced with
+
+  // Writes to a temporary file and renames it so that a crash never leaves a partial checkpoint behind.
+  bool write(const std::string& file_path) const
   {
-    if (!sex_map[i]) continue;
+    std::string tmp_path = file_path + ".tmp";
+    {
+      std::ofstream ofs(tmp_path, std::ios::binary | std::ios::trunc);
+      ofs << "chrom\t" << chrom << "\n"
+          << "pos\t" << pos << "\n"
+          << "records\t" << record_count << "\n"
+          << "unchanged\t" << unchanged_count << "\n"
+          << "same_pos\t" << same_pos_count << "\n"
+          << "offset\t" << offset << "\n"
+          << "contigs";
+      for (auto it = contigs.begin(); it != contigs.end(); ++it)
+        ofs << "\t" << *it;
+      ofs << "\n"
+          << "key\t" << key << "\n";
+      if (!ofs.flush())
+        return false;
+    }
+    return std::rename(tmp_path.c_str(), file_path.c_str()) == 0;
+  }
 
-    for (std::size_t j = 1; j < stride; ++j)
+  // Every field must be present.
+  bool read(const std::string& file_path)
+  {
+    static const char* names[] = {"chrom", "pos", "records", "unchanged", "same_pos", "offset", "contigs", "key"};
+    const std::size_t name_count = sizeof(names) / sizeof(names[0]);
+    std::ifstream ifs(file_path);
+    std::string line;
+    std::vector<bool> seen(name_count, false);
+    while (std::getline(ifs, line))
     {
-      if (gt[i * stride] != gt[i * stride + j])
-      {
-        std::cerr << "Error: cannot convert heterozygous to haploid at " << rec.chrom() << ":" << rec.pos() << ":" << rec.ref() << ":";
-        for (auto it = rec.alts().begin(); it != rec.alts().end(); ++it)
-        {
-          if (it != rec.alts().begin())
-            std::cerr << ",";
-          std::cerr << *it;
-        }
-        std::cerr << ":" << sample_ids[i] << std::endl;
+      auto fields = split_string_to_vector(line.c_str(), '\t');
+      std::size_t idx = std::find(names, names + name_count, fields[0]) - names;
+      if (idx == name_count || seen[idx] || (fields[0] != "contigs" && fields.size() != 2))
         return false;
+      seen[idx] = true;
+
+      switch (idx)
+      {
+      case 0: chrom = fields[1]; break;
+      case 1: pos = std::strtoull(fields[1].c_str(), nullptr, 10); break;
+      case 2: record_count = std::strtoull(fields[1].c_str(), nullptr, 10); break;
+      case 3: unchanged_count = std::strtoull(fields[1].c_str(), nullptr, 10); break;
+      case 4: same_pos_count = std::strtoull(fields[1].c_str(), nullptr, 10); break;
+      case 5: offset = std::strtoull(fields[1].c_str(), nullptr, 10); break;
+      case 6: contigs.assign(fields.begin() + 1, fields.end()); break;
+      default: key = fields[1]; break;
       }
     }
+    return std::find(seen.begin(), seen.end(), false) == seen.end();
   }
+};
 
-  return true;
-}
-
-int main(int argc, char** argv)
+// Ploidy by region and sex, read from rows of CHROM FROM TO SEX PLOIDY like bcftools --ploidy-file. Sex M selects
+// samples coded haploid in the sex map and F all others. Rows of * * * SEX PLOIDY set the default ploidy of a sex,
+// which applies wherever no other rule does; without them it is 2, and such positions are not converted. Samples with
+// ploidy 0 (e.g., females on chrY) are converted to haploid with missing genotypes.
+// Rules are flattened per contig into sorted, non-overlapping intervals, with later rows overriding earlier ones. Since
+// input is sorted, a cursor into the current contig's intervals makes each lookup O(1) amortized.
+class ploidy_rules
 {
-  prog_args args;
-  if (!args.parse(argc, argv))
+public:
+  // Sample masks for one pair of ploidies, built on first use.
+  struct state
   {
-    args.print_usage(std::cerr);
-    return EXIT_FAILURE;
+    std::vector<int> haploid_map; // samples with ploidy 0 or 1
+    std::size_t haploid_count = 0;
+    std::vector<std::size_t> missing_columns; // samples with ploidy 0
+    bool built = false;
+  };
+private:
+  struct rule
+  {
+    std::uint64_t from;
+    std::uint64_t to;
+    int sex; // 0 for F, 1 for M, matching the values of sex_map
+    std::uint8_t ploidy;
+  };
+
+  struct interval
+  {
+    std::uint64_t from;
+    std::uint64_t to;
+    std::uint8_t ploidy[2]; // indexed by sex
+  };
+
+  std::map<std::string, std::vector<rule>> rules_;
+  std::unordered_map<std::string, std::vector<interval>> intervals_;
+  std::uint8_t defaults_[2] = {2, 2}; // indexed by sex
+  std::uint64_t hash_ = 0xcbf29ce484222325ULL;
+  bool loaded_ = false;
+  std::string cursor_chrom_;
+  const std::vector<interval>* cursor_intervals_ = nullptr;
+  std::size_t cursor_ = 0;
+  std::vector<int> sex_map_;
+  state states_[9];
+public:
+  // True unless rules were loaded, even if none of them changes ploidy.
+  bool empty() const { return !loaded_; }
+
+  // Identifies the rules for checkpoint keys.
+  std::uint64_t hash() const { return hash_; }
+
+  bool add(const std::string& chrom, std::uint64_t from, std::uint64_t to, char sex, int ploidy)
+  {
+    if (from < 1 || to < from)
+      return std::cerr << "Error: invalid ploidy rule interval (" << chrom << ":" << from << "-" << to << ")" << std::endl, false;
+    if (sex != 'M' && sex != 'F')
+      return std::cerr << "Error: ploidy rule sex must be M or F (" << sex << ")" << std::endl, false;
+    if (ploidy < 0 || ploidy > 2)
+      return std::cerr << "Error: ploidy must be 0, 1 or 2 (" << ploidy << ")" << std::endl, false;
+
+    rules_[chrom].push_back({from, to, sex == 'M' ? 1 : 0, std::uint8_t(ploidy)});
+    std::string line = chrom + "\t" + std::to_string(from) + "\t" + std::to_string(to) + "\t" + sex + "\t" + std::to_string(ploidy) + "\n";
+    hash_ = fnv1a_hash(line.data(), line.size(), hash_);
+    loaded_ = true;
+    return true;
   }
 
-  if (args.help_is_set())
+  // Finds the longest rule on chrom that gives sex the ploidy, e.g., the non-PAR region of chrX for M and 1.
+  bool longest_rule(const std::string& chrom, char sex, int ploidy, std::uint64_t& from, std::uint64_t& to) const
   {
-    args.print_usage(std::cout);
-    return EXIT_SUCCESS;
+    auto it = rules_.find(chrom);
+    if (it == rules_.end())
+      return false;
+
+    bool found = false;
+    for (auto r = it->second.begin(); r != it->second.end(); ++r)
+    {
+      if (r->sex == (sex == 'M' ? 1 : 0) && r->ploidy == ploidy && (!found || r->to - r->from > to - from))
+        from = r->from, to = r->to, found = true;
+    }
+    return found;
   }
 
-  if (args.version_is_set())
+  // True if any rule applies to one of contigs.
+  bool covers_any(const std::deque<std::string>& contigs) const
   {
-    std::cout << "hds-util v" << VERSION << std::endl;
-    return EXIT_SUCCESS;
+    return std::any_of(contigs.begin(), contigs.end(), [this](const std::string& c) { return rules_.count(c) != 0; });
   }
 
-  savvy::reader input_file(args.input_path());
-  if (!input_file)
-    return std::cerr << "Error: could not open input file\n", EXIT_FAILURE;
+  bool add_default(char sex, int ploidy)
+  {
+    if (sex != 'M' && sex != 'F')
+      return std::cerr << "Error: ploidy rule sex must be M or F (" << sex << ")" << std::endl, false;
+    if (ploidy < 0 || ploidy > 2)
+      return std::cerr << "Error: ploidy must be 0, 1 or 2 (" << ploidy << ")" << std::endl, false;
 
-  savvy::writer output_file(args.output_path(), args.output_format(), input_file.headers(), input_file.samples(), args.compression_level());
-  if (!output_file)
-    return std::cerr << "Error: could not open output file\n", EXIT_FAILURE;
+    defaults_[sex == 'M' ? 1 : 0] = std::uint8_t(ploidy);
+    std::string line = std::string("*\t*\t*\t") + sex + "\t" + std::to_string(ploidy) + "\n";
+    hash_ = fnv1a_hash(line.data(), line.size(), hash_);
+    loaded_ = true;
+    return true;
+  }
 
-  std::vector<int> sex_map(input_file.samples().size(), 1);
-  if (args.sex_map_path().size())
+  // Adds the built-in rules for an assembly: males are haploid on chrX outside the PARs and on chrY, females have no
+  // chrY genotypes, and all samples are haploid on MT. Coordinates match the bcftools defaults.
+  bool add_preset(const std::string& genome)
+  {
+    struct row { const char* chrom; std::uint64_t from; std::uint64_t to; char sex; int ploidy; };
+    static const row grch37[] = {
+      {"X", 1, 60000, 'M', 1},
+      {"X", 2699521, 154931043, 'M', 1},
+      {"Y", 1, 59373566, 'M', 1},
+      {"Y", 1, 59373566, 'F', 0},
+      {"MT", 1, 16569, 'M', 1},
+      {"MT", 1, 16569, 'F', 1}
+    };
+    static const row grch38[] = {
+      {"chrX", 1, 9999, 'M', 1},
+      {"chrX", 2781480, 155701381, 'M', 1},
+      {"chrY", 1, 57227415, 'M', 1},
+      {"chrY", 1, 57227415, 'F', 0},
+      {"chrM", 1, 16569, 'M', 1},
+      {"chrM", 1, 16569, 'F', 1}
+    };
+
+    const row* beg = nullptr;
+    const row* end = nullptr;
+    if (genome == "GRCh37")
+      beg = std::begin(grch37), end = std::end(grch37);
+    else if (genome == "GRCh38")
+      beg = std::begin(grch38), end = std::end(grch38);
+    else
+      return std::cerr << "Error: unknown genome (" << genome << ")" << std::endl, false;
+
+    for (const row* it = beg; it != end; ++it)
+    {
+      if (!add(it->chrom, it->from, it->to, it->sex, it->ploidy))
+        return false;
+    }
+    return true;
+  }
+
+  bool load(const std::string& file_path)
   {
-    std::unordered_map<std::string, std::size_t> id_to_idx;
-    id_to_idx.reserve(input_file.samples().size());
-    for (std::size_t i = 0; i < input_file.samples().size(); ++i)
-      id_to_idx[input_file.samples()[i]] = i;
+    std::ifstream rules_file(file_path);
+    if (!rules_file)
+      return std::cerr << "Error: could not open ploidy file\n", false;
 
     std::string line;
-    std::ifstream sex_map_file(args.sex_map_path());
-    while (std::getline(sex_map_file, line))
+    while (std::getline(rules_file, line))
     {
-      auto fields = split_string_to_vector(line.c_str(), '\t');
-      if (fields.size() < 2)
-        return std::cerr << "Error: malformed sex map\n", EXIT_FAILURE;
+      if (line.empty() || line[0] == '#')
+        continue;
 
-      auto res = id_to_idx.find(fields[0]);
-      if (res == id_to_idx.end())
-      {
-        std::cerr << "Warning: Sex map ID not in VCF (" << fields[0] << ")" << std::endl;
-      }
-      else
+      std::istringstream fields(line);
+      std::string chrom, from, to, sex;
+      int ploidy = -1;
+      if (!(fields >> chrom >> from >> to >> sex >> ploidy) || sex.size() != 1)
+        return std::cerr << "Error: malformed ploidy file (" << line << ")" << std::endl, false;
+
+      if (chrom == "*" && from == "*" && to == "*")
       {
-        if (fields[1] != args.haploid_code())
-          sex_map[res->second] = 0;
+        if (!add_default(sex[0], ploidy))
+          return false;
+        continue;
       }
+
+      char* from_end = nullptr;
+      char* to_end = nullptr;
+      std::uint64_t from_pos = std::strtoull(from.c_str(), &from_end, 10);
+      std::uint64_t to_pos = std::strtoull(to.c_str(), &to_end, 10);
+      if (*from_end || *to_end || from.empty() || to.empty())
+        return std::cerr << "Error: malformed ploidy file (" << line << ")" << std::endl, false;
+      if (!add(chrom, from_pos, to_pos, sex[0], ploidy))
+        return false;
     }
-  }
 
-  int haploid_count = std::accumulate(sex_map.begin(), sex_map.end(), 0);
-  std::cerr << "Notice: converting " << haploid_count << " samples to haploid" << std::endl;
+    loaded_ = true;
+    return true;
+  }
 
-  savvy::variant rec;
-  std::vector<gt_type> gt;
-  while (input_file >> rec)
+  // Flattens the rules and derives the haploid flags of each sample from sex_map.
+  void resolve(const std::vector<int>& sex_map)
   {
-    rec.get_format("GT", gt);
-
-    std::size_t stride = gt.size() / sex_map.size();
+    sex_map_ = sex_map;
+    for (std::size_t i = 0; i < 9; ++i)
+      states_[i] = state();
+    intervals_.clear();
+    cursor_chrom_.clear();
+    cursor_intervals_ = nullptr;
 
-    if (haploid_count == input_file.samples().size())
+    for (auto it = rules_.begin(); it != rules_.end(); ++it)
     {
-      if (args.verify() && !verify(gt, sex_map, rec, input_file.samples()))
-        return EXIT_FAILURE;
+      std::vector<std::uint64_t> bounds;
+      for (auto r = it->second.begin(); r != it->second.end(); ++r)
+      {
+        bounds.push_back(r->from);
+        bounds.push_back(r->to + 1);
+      }
+      std::sort(bounds.begin(), bounds.end());
+      bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
 
-      for (std::size_t i = 0; i < haploid_count; ++i)
-        gt[i] = gt[i * stride];
+      std::vector<interval>& intervals = intervals_[it->first];
+      for (std::size_t i = 0; i + 1 < bounds.size(); ++i)
+      {
+        interval iv = {bounds[i], bounds[i + 1] - 1, {defaults_[0], defaults_[1]}};
+        for (auto r = it->second.begin(); r != it->second.end(); ++r)
+        {
+          if (r->from <= iv.from && iv.to <= r->to)
+            iv.ploidy[r->sex] = r->ploidy;
+        }
 
-      gt.resize(haploid_count);
+        if (std::equal(iv.ploidy, iv.ploidy + 2, defaults_))
+          continue;
+        if (intervals.size() && intervals.back().to + 1 == iv.from && std::equal(iv.ploidy, iv.ploidy + 2, intervals.back().ploidy))
+          intervals.back().to = iv.to;
+        else
+          intervals.push_back(iv);
+      }
     }
-    else
-    {
-      if (args.verify() && !verify(gt, sex_map, rec, input_file.samples()))
-        return EXIT_FAILURE;
+  }
 
-      for (std::size_t i = 0; i < sex_map.size(); ++i)
+  // Returns the sample masks at a position. haploid_count is 0 where every sample keeps ploidy 2.
+  const state& state_at(const std::string& chrom, std::uint64_t pos)
+  {
+    const std::uint8_t* ploidy = lookup(chrom, pos);
+    if (!ploidy)
+      ploidy = defaults_;
+
+    state& st = states_[ploidy[0] * 3 + ploidy[1]];
+    if (!st.built)
+    {
+      st.haploid_map.resize(sex_map_.size());
+      for (std::size_t i = 0; i < sex_map_.size(); ++i)
       {
-        if (sex_map[i])
-        {
-          for (std::size_t j = 1; j < stride; ++j)
-            gt[i * stride + j] = savvy::typed_value::end_of_vector_value<gt_type>();
-        }
+        st.haploid_map[i] = ploidy[sex_map_[i]] < 2;
+        if (ploidy[sex_map_[i]] == 0)
+          st.missing_columns.push_back(i);
       }
+      st.haploid_count = std::size_t(std::count(st.haploid_map.begin(), st.haploid_map.end(), 1));
+      st.built = true;
+    }
+
+    return st;
+  }
+private:
+  const std::uint8_t* lookup(const std::string& chrom, std::uint64_t pos)
+  {
+    if (chrom != cursor_chrom_)
+    {
+      auto it = intervals_.find(chrom);
+      cursor_chrom_ = chrom;
+      cursor_intervals_ = it == intervals_.end() ? nullptr : &it->second;
+      cursor_ = 0;
+    }
+
+    if (!cursor_intervals_)
+      return nullptr;
+
+    const std::vector<interval>& intervals = *cursor_intervals_;
+    if (cursor_ > 0 && pos <= intervals[cursor_ - 1].to)
+    {
+      // Only reached when positions go backwards, which sorted input does not do.
+      cursor_ = std::size_t(std::lower_bound(intervals.begin(), intervals.end(), pos, [](const interval& iv, std::uint64_t p) { return iv.to < p; }) - intervals.begin());
     }
-   
-    rec.set_format("GT", gt); 
-    output_file << rec;
+
+    while (cursor_ < intervals.size() && intervals[cursor_].to < pos)
+      ++cursor_;
+
+    if (cursor_ < intervals.size() && intervals[cursor_].from <= pos)
+      return intervals[cursor_].ploidy;
+    return nullptr;
+  }
+};
+
+std::string conversion_key(const std::vector<std::string>& sample_ids, const std::vector<int>& sex_map, const ploidy_rules& rules)
+{
+  std::uint64_t h = fnv1a_hash(sex_map.data(), sex_map.size() * sizeof(int));
+  if (!rules.empty())
+  {
+    std::uint64_t rules_hash = rules.hash();
+    h = fnv1a_hash(&rules_hash, sizeof(rules_hash), h);
+  }
+  for (auto it = sample_ids.begin(); it != sample_ids.end(); ++it)
+    h = fnv1a_hash(it->c_str(), it->size() + 1, h);
+
+  char buf[17];
+  std::snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)h);
+  return buf;
+}
+
+std::deque<std::string> header_contigs(const std::vector<std::pair<std::string, std::string>>& headers)
+{
+  std::deque<std::string> ret;
+  for (auto it = headers.begin(); it != headers.end(); ++it)
+  {
+    if (it->first == "contig")
+      ret.push_back(header_attribute(it->second, "ID"));
+  }
+  return ret;
+}
+
+// Reads the next record, moving the reader's bounds to the following contig whenever the current one is exhausted.
+// pending_contigs is empty unless the reader was positioned through the index by seek_past().
+bool read_next(savvy::reader& rdr, savvy::variant& rec, std::deque<std::string>& pending_contigs)
+{
+  while (!(rdr >> rec))
+  {
+    if (rdr.bad() || pending_contigs.empty())
+      return false;
+    rdr.reset_bounds(savvy::genomic_region(pending_contigs.front()));
+    pending_contigs.pop_front();
+  }
+  return true;
+}
+
+// Positions the input after the last record recorded in ckpt through its index, verifying that the records skipped at
+// that position are there. The remaining contigs are those of the header that the recorded run had not reached, so
+// none are dropped when the input's contigs are not in header order.
+bool seek_past(const checkpoint& ckpt, savvy::reader& input_file, std::deque<std::string>& pending_contigs)
+{
+  input_file.reset_bounds(savvy::genomic_region(ckpt.chrom, ckpt.pos));
+  if (!input_file.good())
+    return std::cerr << "Error: --resume and --incremental require an indexed input file" << std::endl, false;
+
+  savvy::variant rec;
+  for (std::size_t i = 0; i < ckpt.same_pos_count; ++i)
+  {
+    if (!(input_file >> rec) || rec.chrom() != ckpt.chrom || rec.pos() != ckpt.pos)
+      return std::cerr << "Error: input does not match previous output at " << ckpt.chrom << ":" << ckpt.pos << std::endl, false;
+  }
+
+  std::unordered_set<std::string> done(ckpt.contigs.begin(), ckpt.contigs.end());
+  std::deque<std::string> contigs = header_contigs(input_file.headers());
+  if (std::find(contigs.begin(), contigs.end(), ckpt.chrom) == contigs.end())
+    return std::cerr << "Error: contig " << ckpt.chrom << " is missing from the input header" << std::endl, false;
+  pending_contigs.clear();
+  for (auto it = contigs.begin(); it != contigs.end(); ++it)
+  {
+    if (!done.count(*it))
+      pending_contigs.push_back(*it);
   }
 
+  return true;
+}
+
+bool verify(const std::vector<gt_type>& gt, const std::vector<int>& sex_map, const savvy::variant& rec, const std::vector<std::string>& sample_ids)
+{
+  std::size_t stride = gt.size() / sex_map.size();
+  for (std::size_t i = 0; i < sex_map.size(); ++i)
+  {
+    if (!sex_map[i]) continue;
+
+    for (std::size_t j = 1; j < stride; ++j)
+    {
+      if (gt[i * stride + j] == savvy::typed_value::end_of_vector_value<gt_type>())
+        continue; // already converted
+
+      if (gt[i * stride] != gt[i * stride + j])
+      {
+        std::cerr << "Error: cannot convert heterozygous to haploid at " << rec.chrom() << ":" << rec.pos() << ":" << rec.ref() << ":";
+        for (auto it = rec.alts().begin(); it != rec.alts().end(); ++it)
+        {
+          if (it != rec.alts().begin())
+            std::cerr << ",";
+          std::cerr << *it;
+        }
+        std::cerr << ":" << sample_ids[i] << std::endl;
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+// Converts haploid samples in place, either by compacting the vector (all samples haploid) or by padding with
+// end-of-vector values (mixed ploidy). Returns false if the vector was left unchanged, in which case the caller
+// can forward the original record without re-encoding the field. Non-zero values of a converted vector are
+// counted during the same scan so that the caller can choose between sparse and dense storage.
+template <typename T>
+bool convert_to_haploid(std::vector<T>& vec, const std::vector<int>& sex_map, std::size_t haploid_count, std::size_t& non_zero_count)
+{
+  non_zero_count = 0;
+  if (sex_map.empty() || vec.size() <= sex_map.size())
+    return false; // missing field or already haploid
+
+  std::size_t stride = vec.size() / sex_map.size();
+  if (haploid_count == sex_map.size())
+  {
+    for (std::size_t i = 0; i < haploid_count; ++i)
+    {
+      vec[i] = vec[i * stride];
+      non_zero_count += vec[i] != T();
+    }
+
+    vec.resize(haploid_count);
+    return true;
+  }
+
+  const T eov = savvy::typed_value::end_of_vector_value<T>();
+  bool changed = false;
+  for (std::size_t i = 0; i < sex_map.size(); ++i)
+  {
+    if (sex_map[i])
+    {
+      for (std::size_t j = 1; j < stride; ++j)
+      {
+        // Compared bitwise since the floating-point end-of-vector value is a NaN.
+        changed = changed || std::memcmp(&vec[i * stride + j], &eov, sizeof(T)) != 0;
+        vec[i * stride + j] = eov;
+      }
+    }
+
+    for (std::size_t j = 0; j < stride; ++j)
+      non_zero_count += vec[i * stride + j] != T();
+  }
+
+  return changed;
+}
+
+// Stores sparse when the fraction of non-zero values is below the threshold, and dense otherwise.
+template <typename T>
+void set_format_adaptive(savvy::variant& rec, const std::string& key, const std::vector<T>& vec, std::size_t non_zero_count, float sparse_threshold, savvy::compressed_vector<T>& sparse_vec)
+{
+  if (vec.size() && float(non_zero_count) < sparse_threshold * float(vec.size()))
+  {
+    sparse_vec.assign(vec.begin(), vec.end());
+    rec.set_format(key, sparse_vec);
+  }
+  else
+  {
+    rec.set_format(key, vec);
+  }
+}
+
+// Sets DS of haploid samples to the dosage of their first haplotype. Must be called before HDS is converted.
+bool update_haploid_dosages(std::vector<float>& ds, const std::vector<float>& hds, const std::vector<int>& sex_map)
+{
+  if (ds.size() != sex_map.size() || hds.size() <= sex_map.size())
+    return false;
+
+  std::size_t stride = hds.size() / sex_map.size();
+  bool changed = false;
+  for (std::size_t i = 0; i < sex_map.size(); ++i)
+  {
+    if (sex_map[i] && std::memcmp(&ds[i], &hds[i * stride], sizeof(float)) != 0)
+    {
+      ds[i] = hds[i * stride];
+      changed = true;
+    }
+  }
+
+  return changed;
+}
+
+// Positions of the homozygous genotypes (k/k at k * (k + 3) / 2) in a diploid Number=G vector, cached per allele count.
+class homozygous_index_table
+{
+private:
+  std::vector<std::vector<std::size_t>> tables_;
+public:
+  const std::vector<std::size_t>& operator()(std::size_t n_alleles)
+  {
+    if (n_alleles >= tables_.size())
+      tables_.resize(n_alleles + 1);
+
+    std::vector<std::size_t>& t = tables_[n_alleles];
+    if (t.empty())
+    {
+      t.resize(n_alleles);
+      for (std::size_t k = 0; k < n_alleles; ++k)
+        t[k] = k * (k + 3) / 2;
+    }
+    return t;
+  }
+};
+
+// Reduces a diploid Number=G field to one value per allele for haploid samples by keeping the homozygous entries.
+// Vectors that do not have diploid cardinality (e.g., already converted) are left unchanged.
+template <typename T>
+bool convert_genotype_field_to_haploid(std::vector<T>& vec, const std::vector<int>& sex_map, std::size_t haploid_count, const std::vector<std::size_t>& hom_idx)
+{
+  std::size_t n = hom_idx.size();
+  std::size_t stride = n * (n + 1) / 2;
+  if (sex_map.empty() || haploid_count == 0 || n < 2 || vec.size() != stride * sex_map.size())
+    return false;
+
+  // Writes never pass reads since hom_idx[k] >= k and stride >= n, so compaction can be done in place.
+  if (haploid_count == sex_map.size())
+  {
+    for (std::size_t i = 0; i < sex_map.size(); ++i)
+    {
+      for (std::size_t k = 0; k < n; ++k)
+        vec[i * n + k] = vec[i * stride + hom_idx[k]];
+    }
+
+    vec.resize(sex_map.size() * n);
+    return true;
+  }
+
+  const T eov = savvy::typed_value::end_of_vector_value<T>();
+  bool changed = false;
+  for (std::size_t i = 0; i < sex_map.size(); ++i)
+  {
+    // The last homozygous entry is padded with end-of-vector once a sample has been converted.
+    if (sex_map[i] && std::memcmp(&vec[(i + 1) * stride - 1], &eov, sizeof(T)) != 0)
+    {
+      for (std::size_t k = 0; k < n; ++k)
+        vec[i * stride + k] = vec[i * stride + hom_idx[k]];
+      std::fill(vec.begin() + i * stride + n, vec.begin() + (i + 1) * stride, eov);
+      changed = true;
+    }
+  }
+
+  return changed;
+}
+
+void set_pbwt_flags(savvy::variant& rec, const std::vector<std::string>& pbwt_fields)
+{
+  for (auto it = rec.format_fields().begin(); it != rec.format_fields().end(); ++it)
+  {
+    if (std::find(pbwt_fields.begin(), pbwt_fields.end(), it->first) != pbwt_fields.end())
+      it->second.pbwt_flag(true);
+  }
+}
+
+// Read-only contents of a whole file. Regular files are mapped. Anything else, such as a FIFO from process
+// substitution, reports no size and is read into an owned buffer instead.
+class mapped_file
+{
+private:
+  int fd_ = -1;
+  const char* data_ = nullptr;
+  std::size_t size_ = 0;
+  std::vector<char> buffer_;
+  bool mapped_ = false;
+  bool good_ = false;
+public:
+  explicit mapped_file(const std::string& file_path)
+  {
+    struct stat st;
+    fd_ = open(file_path.c_str(), O_RDONLY);
+    if (fd_ < 0 || fstat(fd_, &st) != 0)
+      return;
+
+    if (!S_ISREG(st.st_mode))
+    {
+      std::size_t len = 0;
+      ssize_t res = 0;
+      do
+      {
+        len += std::size_t(std::max(res, ssize_t(0)));
+        if (buffer_.size() - len < 65536)
+          buffer_.resize(len + 65536);
+        res = read(fd_, buffer_.data() + len, buffer_.size() - len);
+      } while (res > 0 || (res < 0 && errno == EINTR));
+      if (res < 0)
+        return;
+      buffer_.resize(len);
+      data_ = buffer_.data();
+      size_ = len;
+      good_ = true;
+      return;
+    }
+
+    size_ = std::size_t(st.st_size);
+    if (size_)
+    {
+      void* addr = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+      if (addr == MAP_FAILED)
+        return;
+      data_ = static_cast<const char*>(addr);
+      mapped_ = true;
+      madvise(const_cast<char*>(data_), size_, MADV_SEQUENTIAL);
+    }
+    good_ = true;
+  }
+
+  ~mapped_file()
+  {
+    if (mapped_)
+      munmap(const_cast<char*>(data_), size_);
+    if (fd_ >= 0)
+      close(fd_);
+  }
+
+  mapped_file(const mapped_file&) = delete;
+  mapped_file& operator=(const mapped_file&) = delete;
+
+  bool good() const { return good_; }
+  const char* data() const { return data_; }
+  std::size_t size() const { return size_; }
+};
+
+// Non-owning view of a character range.
+struct string_ref
+{
+  const char* data;
+  std::size_t size;
+
+  bool operator==(const string_ref& other) const { return size == other.size && std::memcmp(data, other.data, size) == 0; }
+  bool operator!=(const string_ref& other) const { return !(*this == other); }
+};
+
+// Maps sample IDs to column indices. IDs are copied once into a contiguous arena and looked up through a flat
+// open-addressing table with linear probing. The table is kept at most half full and stores a hash tag per sample, so
+// most probes that miss are rejected without touching the arena. When IDs are duplicated, the first column wins.
+class sample_index
+{
+private:
+  std::vector<char> arena_;
+  std::vector<std::size_t> offsets_;
+  std::vector<std::uint32_t> tags_;
+  std::vector<std::uint32_t> slots_; // column + 1, or 0 when empty
+  std::size_t mask_ = 0;
+public:
+  static const std::size_t npos = std::size_t(-1);
+
+  sample_index() {}
+
+  explicit sample_index(const std::vector<std::string>& ids)
+  {
+    std::size_t arena_size = 0;
+    for (auto it = ids.begin(); it != ids.end(); ++it)
+      arena_size += it->size();
+    arena_.reserve(arena_size);
+    offsets_.reserve(ids.size() + 1);
+    tags_.reserve(ids.size());
+
+    std::size_t capacity = 16;
+    while (capacity < ids.size() * 2)
+      capacity *= 2;
+    slots_.assign(capacity, 0);
+    mask_ = capacity - 1;
+
+    offsets_.push_back(0);
+    for (std::size_t i = 0; i < ids.size(); ++i)
+    {
+      arena_.insert(arena_.end(), ids[i].begin(), ids[i].end());
+      offsets_.push_back(arena_.size());
+      std::uint64_t h = fnv1a_hash(ids[i].data(), ids[i].size());
+      tags_.push_back(std::uint32_t(h >> 32));
+
+      string_ref key = {ids[i].data(), ids[i].size()};
+      std::size_t slot = std::size_t(h) & mask_;
+      while (slots_[slot] && !(tags_[slots_[slot] - 1] == tags_[i] && id(slots_[slot] - 1) == key))
+        slot = (slot + 1) & mask_;
+      if (!slots_[slot])
+        slots_[slot] = std::uint32_t(i + 1);
+    }
+  }
+
+  std::size_t size() const { return tags_.size(); }
+
+  string_ref id(std::size_t column) const { return {arena_.data() + offsets_[column], offsets_[column + 1] - offsets_[column]}; }
+
+  // Returns the column of the ID or npos.
+  std::size_t find(const string_ref& key) const
+  {
+    if (slots_.empty())
+      return npos;
+    std::uint64_t h = fnv1a_hash(key.data, key.size);
+    std::uint32_t tag = std::uint32_t(h >> 32);
+    for (std::size_t slot = std::size_t(h) & mask_; slots_[slot]; slot = (slot + 1) & mask_)
+    {
+      std::size_t column = slots_[slot] - 1;
+      if (tags_[column] == tag && id(column) == key)
+        return column;
+    }
+    return npos;
+  }
+
+  std::size_t find(const std::string& key) const { return find(string_ref{key.data(), key.size()}); }
+};
+
+const std::size_t sample_index::npos;
+
+// Column positions of the sample ID and sex in a sex map file. Besides the two-column TSV, PLINK .fam files
+// (whitespace separated FID, IID, PAT, MAT, SEX, PHENO) and .psam files (tab separated, with a #FID or #IID header
+// naming the columns) are read directly.
+struct sex_map_layout
+{
+  std::size_t id_column = 0;
+  std::size_t sex_column = 1;
+  std::size_t header_size = 0;
+  bool whitespace = false; // fields are separated by runs of spaces and tabs rather than single tabs
+  bool plink = false;
+};
+
+// Finds the field at column in [p, eol) without copying. Returns false if the line has fewer fields.
+bool find_field(const char* p, const char* eol, std::size_t column, bool whitespace, string_ref& field)
+{
+  for (std::size_t i = 0; ; ++i)
+  {
+    const char* field_end;
+    if (whitespace)
+    {
+      while (p < eol && (*p == ' ' || *p == '\t'))
+        ++p;
+      field_end = p;
+      while (field_end < eol && *field_end != ' ' && *field_end != '\t')
+        ++field_end;
+      if (p == field_end)
+        return false;
+    }
+    else
+    {
+      field_end = static_cast<const char*>(std::memchr(p, '\t', std::size_t(eol - p)));
+      if (!field_end)
+        field_end = eol;
+    }
+
+    if (i == column)
+      return field = {p, std::size_t(field_end - p)}, true;
+    if (field_end == eol)
+      return false;
+    p = whitespace ? field_end : field_end + 1;
+  }
+}
+
+const char* line_end(const char* p, const char* end)
+{
+  if (p == end)
+    return end;
+  const char* eol = static_cast<const char*>(std::memchr(p, '\n', std::size_t(end - p)));
+  return eol ? eol : end;
+}
+
+bool ends_with(const std::string& str, const std::string& suffix)
+{
+  return str.size() >= suffix.size() && str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// Detects the sex map format from the .psam header or, failing that, the .fam and .psam extensions.
+bool detect_sex_map_layout(const std::string& file_path, const mapped_file& sex_map_file, sex_map_layout& layout)
+{
+  const char* p = sex_map_file.data();
+  const char* const end = p + sex_map_file.size();
+  const char* eol = line_end(p, end);
+  layout = sex_map_layout();
+
+  if (end - p > 4 && (std::memcmp(p, "#FID", 4) == 0 || std::memcmp(p, "#IID", 4) == 0))
+  {
+    layout.plink = true;
+    layout.header_size = std::size_t(std::min(eol + 1, end) - p);
+    layout.id_column = layout.sex_column = std::size_t(-1);
+    string_ref name;
+    for (std::size_t i = 0; find_field(p + 1, eol, i, false, name); ++i)
+    {
+      if (name.size && name.data[name.size - 1] == '\r')
+        --name.size;
+      if (name == string_ref{"IID", 3})
+        layout.id_column = i;
+      else if (name == string_ref{"SEX", 3})
+        layout.sex_column = i;
+    }
+    if (layout.id_column == std::size_t(-1) || layout.sex_column == std::size_t(-1))
+      return std::cerr << "Error: .psam sex map requires IID and SEX columns\n", false;
+  }
+  else if (ends_with(file_path, ".fam") || ends_with(file_path, ".psam"))
+  {
+    // A .psam file without a header line has the .fam layout.
+    layout.plink = true;
+    layout.whitespace = true;
+    layout.id_column = 1;
+    layout.sex_column = 4;
+  }
+
+  return true;
+}
+
+// Clears sex_map for samples whose code in the sex map file differs from haploid_code. The file is mapped and
+// tokenized in place, and IDs are looked up as views into the file, so no per-line allocation is made. IDs are
+// resolved against all input samples and mapped to sex_map through subset_columns, where unselected samples are
+// npos; an empty subset_columns means every input sample is selected.
+bool load_sex_map(const mapped_file& sex_map_file, const sex_map_layout& layout, const sample_index& id_to_idx, const std::vector<std::size_t>& subset_columns, const std::string& haploid_code, std::vector<int>& sex_map)
+{
+  const string_ref code = {haploid_code.data(), haploid_code.size()};
+  const char* p = sex_map_file.data() + layout.header_size;
+  const char* const end = sex_map_file.data() + sex_map_file.size();
+  std::size_t entry_count = 0;
+  while (p < end)
+  {
+    const char* eol = line_end(p, end);
+    const char* next = eol + 1;
+    if (eol > p && eol[-1] == '\r')
+      --eol;
+
+    string_ref id, sex;
+    if (!find_field(p, eol, layout.id_column, layout.whitespace, id) || !find_field(p, eol, layout.sex_column, layout.whitespace, sex))
+      return std::cerr << "Error: malformed sex map\n", false;
+
+    ++entry_count;
+    std::size_t res = id_to_idx.find(id);
+    if (res == sample_index::npos)
+    {
+      std::cerr << "Warning: Sex map ID not in VCF (";
+      std::cerr.write(id.data, std::streamsize(id.size));
+      std::cerr << ")" << std::endl;
+    }
+    else
+    {
+      if (subset_columns.size())
+        res = subset_columns[res];
+      if (res != sample_index::npos && sex != code)
+        sex_map[res] = 0;
+    }
+
+    p = next;
+  }
+
+  if (!entry_count)
+    std::cerr << "Warning: sex map has no entries; all samples are presumed haploid" << std::endl;
+  return true;
+}
+
+// Collects the samples selected with --samples or --samples-file. IDs missing from the input are reported and ignored.
+bool load_sample_subset(const prog_args& args, const sample_index& id_to_idx, std::unordered_set<std::string>& subset)
+{
+  std::vector<std::string> ids = args.samples();
+  if (args.samples_file_path().size())
+  {
+    std::ifstream samples_file(args.samples_file_path());
+    if (!samples_file)
+      return std::cerr << "Error: could not open samples file\n", false;
+
+    std::string line;
+    while (std::getline(samples_file, line))
+    {
+      if (line.size() && line.back() == '\r')
+        line.pop_back();
+      if (line.size())
+        ids.push_back(line);
+    }
+  }
+
+  for (auto it = ids.begin(); it != ids.end(); ++it)
+  {
+    if (id_to_idx.find(*it) == sample_index::npos)
+      std::cerr << "Warning: sample not in VCF (" << *it << ")" << std::endl;
+    else
+      subset.insert(*it);
+  }
+
+  if (subset.empty())
+    return std::cerr << "Error: none of the selected samples are in the input\n", false;
+  return true;
+}
+
+// The binary sex map cache holds the resolved haploid flags as a bitmask, keyed by a hash of the sample list, the sex
+// map contents and format, and the haploid code. Layout: 8-byte magic, 64-bit key, 64-bit sample count, bitmask.
+const char sex_map_cache_magic[8] = {'D', 'I', '2', 'H', 'S', 'M', 'C', '1'};
+
+std::uint64_t sex_map_cache_key(const std::vector<std::string>& sample_ids, const mapped_file& sex_map_file, const sex_map_layout& layout, const std::string& haploid_code)
+{
+  std::uint64_t h = fnv1a_hash(sex_map_file.data(), sex_map_file.size());
+  std::uint64_t columns[3] = {layout.id_column, layout.sex_column, layout.whitespace};
+  h = fnv1a_hash(columns, sizeof(columns), h);
+  h = fnv1a_hash(haploid_code.c_str(), haploid_code.size() + 1, h);
+  for (auto it = sample_ids.begin(); it != sample_ids.end(); ++it)
+    h = fnv1a_hash(it->c_str(), it->size() + 1, h);
+  return h;
+}
+
+bool load_sex_map_cache(const std::string& file_path, std::uint64_t key, std::vector<int>& sex_map)
+{
+  mapped_file cache(file_path);
+  std::size_t mask_size = (sex_map.size() + 7) / 8;
+  if (!cache.good() || cache.size() != sizeof(sex_map_cache_magic) + 16 + mask_size || std::memcmp(cache.data(), sex_map_cache_magic, sizeof(sex_map_cache_magic)) != 0)
+    return false;
+
+  std::uint64_t header[2];
+  std::memcpy(header, cache.data() + sizeof(sex_map_cache_magic), sizeof(header));
+  if (header[0] != key || header[1] != sex_map.size())
+    return false;
+
+  const unsigned char* mask = reinterpret_cast<const unsigned char*>(cache.data() + sizeof(sex_map_cache_magic) + sizeof(header));
+  for (std::size_t i = 0; i < sex_map.size(); ++i)
+    sex_map[i] = (mask[i / 8] >> (i % 8)) & 1;
+  return true;
+}
+
+bool write_sex_map_cache(const std::string& file_path, std::uint64_t key, const std::vector<int>& sex_map)
+{
+  std::vector<unsigned char> mask((sex_map.size() + 7) / 8, 0);
+  for (std::size_t i = 0; i < sex_map.size(); ++i)
+    mask[i / 8] |= (unsigned char)((sex_map[i] ? 1 : 0) << (i % 8));
+
+  std::uint64_t header[2] = {key, sex_map.size()};
+  std::string tmp_path = file_path + ".tmp";
+  {
+    std::ofstream ofs(tmp_path, std::ios::binary | std::ios::trunc);
+    ofs.write(sex_map_cache_magic, sizeof(sex_map_cache_magic));
+    ofs.write(reinterpret_cast<const char*>(header), sizeof(header));
+    ofs.write(reinterpret_cast<const char*>(mask.data()), std::streamsize(mask.size()));
+    if (!ofs.flush())
+      return false;
+  }
+  return std::rename(tmp_path.c_str(), file_path.c_str()) == 0;
+}
+
+// Infers haploid (male) samples from heterozygosity on the non-PAR region of chrX, similar to plink's --check-sex.
+// Records are sampled evenly across the region through the index, so only a small part of the input is decoded.
+// Sites with a minor allele frequency below 5% carry little signal and are skipped. For each sample, observed
+// heterozygous calls are compared with the count expected under Hardy-Weinberg equilibrium, and the resulting
+// inbreeding coefficient F is near 1 for males and near 0 for females. Samples with too few informative sites or an
+// F between the thresholds are left diploid.
+bool infer_sex(const prog_args& args, const std::vector<std::string>& sample_ids, std::vector<int>& sex_map)
+{
+  // Without --genome, the intersection of the GRCh37 and GRCh38 non-PAR regions is used.
+  std::uint64_t non_par_from = 2781480, non_par_to = 154931043;
+  const std::size_t strata = 100;
+  const std::uint32_t min_sites = 20;
+  const float min_maf = 0.05f;
+
+  savvy::reader rdr(args.input_path());
+  if (!rdr)
+    return std::cerr << "Error: could not open input file for --infer-sex (" << args.input_path() << ")" << std::endl, false;
+  if (args.subset_samples())
+    rdr.subset_samples(std::unordered_set<std::string>(sample_ids.begin(), sample_ids.end()));
+
+  std::deque<std::string> contigs = header_contigs(rdr.headers());
+  auto chrom = std::find_if(contigs.begin(), contigs.end(), [](const std::string& c) { return c == "X" || c == "chrX"; });
+  if (chrom == contigs.end())
+    return std::cerr << "Error: --infer-sex requires an X or chrX contig in the input header" << std::endl, false;
+
+  if (args.genome().size())
+  {
+    ploidy_rules preset;
+    if (!preset.add_preset(args.genome()))
+      return false;
+    if (!preset.longest_rule(*chrom, 'M', 1, non_par_from, non_par_to))
+      std::cerr << "Warning: " << *chrom << " is not named as in " << args.genome() << "; using default non-PAR bounds for --infer-sex" << std::endl;
+  }
+
+  std::size_t n = sample_ids.size();
+  std::vector<std::uint32_t> site_counts(n, 0), het_counts(n, 0);
+  std::vector<float> expected_het(n, 0.f);
+  std::vector<gt_type> gt;
+  savvy::variant rec;
+  std::size_t per_stratum = (args.infer_sex_records() + strata - 1) / strata;
+  std::size_t record_count = 0, informative_count = 0;
+  for (std::size_t s = 0; s < strata; ++s)
+  {
+    std::uint64_t from = non_par_from + (non_par_to - non_par_from) * s / strata;
+    std::uint64_t to = non_par_from + (non_par_to - non_par_from) * (s + 1) / strata - 1;
+    rdr.reset_bounds(savvy::genomic_region(*chrom, from, to));
+    if (s == 0 && !rdr.good())
+      return std::cerr << "Error: --infer-sex requires an indexed input file" << std::endl, false;
+
+    for (std::size_t i = 0; i < per_stratum && rdr >> rec; ++i)
+    {
+      ++record_count;
+      rec.get_format("GT", gt);
+      if (gt.size() != n * 2)
+        continue; // not diploid for every sample
+
+      std::size_t alt_count = 0, called_count = 0;
+      for (std::size_t j = 0; j < gt.size(); ++j)
+      {
+        alt_count += gt[j] > 0;
+        called_count += gt[j] >= 0;
+      }
+      float af = called_count ? float(alt_count) / float(called_count) : 0.f;
+      if (std::min(af, 1.f - af) < min_maf)
+        continue;
+      ++informative_count;
+
+      // Branchless so that the compiler can vectorize the per-sample counters.
+      float het_probability = 2.f * af * (1.f - af);
+      const gt_type* g = gt.data();
+      for (std::size_t j = 0; j < n; ++j)
+      {
+        std::uint32_t called = std::uint32_t((g[j * 2] >= 0) & (g[j * 2 + 1] >= 0));
+        site_counts[j] += called;
+        het_counts[j] += called & std::uint32_t(g[j * 2] != g[j * 2 + 1]);
+        expected_het[j] += float(called) * het_probability;
+      }
+    }
+  }
+
+  std::ofstream dump;
+  if (args.infer_sex_output_path().size())
+  {
+    dump.open(args.infer_sex_output_path());
+    if (!dump)
+      return std::cerr << "Error: could not open --infer-sex-output file (" << args.infer_sex_output_path() << ")" << std::endl, false;
+    dump << "ID\tSEX\tF\tN_SITES\n";
+  }
+
+  std::size_t male_count = 0, female_count = 0, unknown_count = 0;
+  for (std::size_t i = 0; i < n; ++i)
+  {
+    char sex = 'U';
+    float f = expected_het[i] > 0.f ? 1.f - float(het_counts[i]) / expected_het[i] : 0.f;
+    if (site_counts[i] >= min_sites && f >= args.infer_sex_male_min())
+      sex = 'M';
+    else if (site_counts[i] >= min_sites && f <= args.infer_sex_female_max())
+      sex = 'F';
+
+    sex_map[i] = sex == 'M';
+    sex == 'M' ? ++male_count : sex == 'F' ? ++female_count : ++unknown_count;
+    if (dump.is_open())
+      dump << sample_ids[i] << "\t" << sex << "\t" << f << "\t" << site_counts[i] << "\n";
+  }
+
+  if (dump.is_open() && !dump.flush())
+    return std::cerr << "Error: failed writing --infer-sex-output file" << std::endl, false;
+
+  if (unknown_count)
+    std::cerr << "Warning: could not infer sex of " << unknown_count << " samples; they are left diploid" << std::endl;
+  if (args.verbose())
+  {
+    std::cerr << "Notice: --infer-sex used " << informative_count << " of " << record_count << " sampled " << *chrom << " records" << std::endl;
+    std::cerr << "Notice: inferred " << male_count << " haploid and " << female_count << " diploid samples" << std::endl;
+  }
+
+  return true;
+}
+
+// Grows the capacity of a pipe and returns the effective capacity, or 0 if fd is not a pipe.
+std::size_t set_pipe_size(int fd, std::size_t size)
+{
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISFIFO(st.st_mode))
+    return 0;
+
+#if defined(F_SETPIPE_SZ) && defined(F_GETPIPE_SZ)
+  if (size && fcntl(fd, F_SETPIPE_SZ, int(std::min(size, std::size_t(std::numeric_limits<int>::max())))) < 0)
+    std::cerr << "Warning: could not set pipe capacity to " << size << " bytes (" << std::strerror(errno) << ")" << std::endl;
+
+  int res = fcntl(fd, F_GETPIPE_SZ);
+  return res > 0 ? std::size_t(res) : 0;
+#else
+  return 0;
+#endif
+}
+
+// Decouples the writer from output latency. savvy writes its compressed stream into a pipe, one thread drains the
+// pipe into a pool of buffers and assigns each its file offset, and several threads write full buffers to the output
+// path with pwrite() at those offsets, so that multiple writes are in flight. Buffers are recycled once written, so the
+// record loop only stalls when every buffer is waiting on the filesystem. Output that is not a regular file (e.g., a
+// pipe) has no offsets and is written by a single thread in order.
+//
+// With direct I/O, regular output files bypass the page cache. Buffers are page aligned and a multiple of the page
+// size, and only the final buffer can be partial, so O_DIRECT is cleared just for its unaligned tail. Preallocation
+// reserves disk space up front without changing the file size, and the unused remainder is released at the end.
+// Output appended to an existing file (e.g., stdout redirected with >>) starts at that file's end, so direct I/O is
+// only used when that offset is aligned, and the release truncates at the end of the new data.
+class async_output
+{
+private:
+  int out_fd_ = -1;
+  int pipe_fds_[2] = {-1, -1};
+  char* pool_ = nullptr;
+  std::size_t buffer_size_;
+  std::size_t alignment_;
+  std::vector<std::size_t> lengths_;
+  std::vector<off_t> offsets_;
+  std::deque<std::size_t> free_;
+  std::deque<std::size_t> full_;
+  off_t start_offset_ = 0;
+  off_t end_offset_ = 0;
+  bool positional_ = false;
+  bool append_ = false;
+  bool direct_ = false;
+  bool preallocated_ = false;
+  bool eof_ = false;
+  bool failed_ = false;
+  std::mutex mtx_;
+  std::condition_variable cv_;
+  std::thread fill_thread_;
+  std::vector<std::thread> flush_threads_;
+public:
+  async_output(const std::string& file_path, std::size_t buffer_size, std::size_t buffer_count, std::size_t pipe_size, bool direct_io = false, std::size_t preallocate_size = 0) :
+    alignment_(std::max(std::size_t(4096), std::size_t(sysconf(_SC_PAGESIZE)))),
+    lengths_(buffer_count, 0),
+    offsets_(buffer_count, 0)
+  {
+    buffer_size_ = (buffer_size + alignment_ - 1) / alignment_ * alignment_;
+    void* mem = nullptr;
+    if (posix_memalign(&mem, alignment_, buffer_size_ * buffer_count) != 0)
+      return;
+    pool_ = static_cast<char*>(mem);
+
+    // Stdout is duplicated rather than reopened so that a shell redirection in append mode is not truncated.
+    out_fd_ = file_path == "/dev/stdout" ? dup(STDOUT_FILENO) : open(file_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (out_fd_ < 0 || pipe(pipe_fds_) != 0)
+      return;
+
+    struct stat st;
+    bool regular_file = fstat(out_fd_, &st) == 0 && S_ISREG(st.st_mode);
+    if (regular_file)
+    {
+      // With O_APPEND the offset only moves to the end of the file on the first write.
+      append_ = (fcntl(out_fd_, F_GETFL) & O_APPEND) != 0;
+      start_offset_ = append_ ? st.st_size : lseek(out_fd_, 0, SEEK_CUR);
+      regular_file = start_offset_ >= 0;
+    }
+
+    // pwrite() ignores the offset under O_APPEND on Linux, so the flag is cleared until finish().
+    positional_ = regular_file && (!append_ || fcntl(out_fd_, F_SETFL, fcntl(out_fd_, F_GETFL) & ~O_APPEND) == 0);
+    end_offset_ = start_offset_;
+
+    if (direct_io)
+    {
+      direct_ = positional_ && start_offset_ % off_t(alignment_) == 0 && fcntl(out_fd_, F_SETFL, fcntl(out_fd_, F_GETFL) | O_DIRECT) == 0;
+      if (!direct_)
+        std::cerr << "Warning: direct I/O is not available for the output; using buffered writes" << std::endl;
+    }
+
+#ifdef FALLOC_FL_KEEP_SIZE
+    if (preallocate_size && regular_file)
+    {
+      preallocated_ = fallocate(out_fd_, FALLOC_FL_KEEP_SIZE, start_offset_, off_t(preallocate_size)) == 0;
+      if (!preallocated_)
+        std::cerr << "Warning: could not preallocate output (" << std::strerror(errno) << ")" << std::endl;
+    }
+#endif
+
+    if (pipe_size)
+      set_pipe_size(pipe_fds_[0], pipe_size);
+
+    for (std::size_t i = 0; i < buffer_count; ++i)
+      free_.push_back(i);
+
+    fill_thread_ = std::thread(&async_output::fill, this);
+    std::size_t flush_count = positional_ ? std::max(std::size_t(1), buffer_count / 2) : 1;
+    for (std::size_t i = 0; i < flush_count; ++i)
+      flush_threads_.emplace_back(&async_output::flush, this);
+  }
+
+  ~async_output()
+  {
+    finish();
+    std::free(pool_);
+  }
+
+  bool good() const { return pool_ && out_fd_ >= 0 && pipe_fds_[1] >= 0; }
+
+  // Path for savvy::writer to open. Call close_pipe() once the writer has opened it.
+  std::string pipe_path() const { return "/dev/fd/" + std::to_string(pipe_fds_[1]); }
+
+  void close_pipe()
+  {
+    if (pipe_fds_[1] >= 0)
+      close(pipe_fds_[1]);
+    pipe_fds_[1] = -1;
+  }
+
+  // Waits for all buffered data to be written. The writer must be destroyed first so that the pipe reaches EOF.
+  bool finish()
+  {
+    close_pipe();
+    if (fill_thread_.joinable())
+      fill_thread_.join();
+    for (auto it = flush_threads_.begin(); it != flush_threads_.end(); ++it)
+    {
+      if (it->joinable())
+        it->join();
+    }
+    if (pipe_fds_[0] >= 0)
+      close(pipe_fds_[0]), pipe_fds_[0] = -1;
+    if (out_fd_ >= 0)
+    {
+      if (positional_)
+      {
+        // pwrite() leaves the file offset alone, which a shared stdout description should see at the end of the data.
+        if (lseek(out_fd_, end_offset_, SEEK_SET) < 0)
+          failed_ = true;
+        if (append_)
+          fcntl(out_fd_, F_SETFL, fcntl(out_fd_, F_GETFL) | O_APPEND);
+      }
+
+      // Releases preallocated space past the end of the data, which need not start at offset 0.
+      if (preallocated_ && ftruncate(out_fd_, end_offset_) != 0)
+        failed_ = true;
+      if (close(out_fd_) != 0)
+        failed_ = true;
+    }
+    out_fd_ = -1;
+    return !failed_;
+  }
+private:
+  void fill()
+  {
+    while (true)
+    {
+      std::size_t idx;
+      {
+        std::unique_lock<std::mutex> lock(mtx_);
+        cv_.wait(lock, [this]() { return !free_.empty(); });
+        idx = free_.front();
+        free_.pop_front();
+      }
+
+      char* buf = pool_ + idx * buffer_size_;
+      std::size_t len = 0;
+      ssize_t res = 0;
+      while (len < buffer_size_ && ((res = read(pipe_fds_[0], buf + len, buffer_size_ - len)) > 0 || (res < 0 && errno == EINTR)))
+        len += std::size_t(std::max(res, ssize_t(0)));
+
+      std::lock_guard<std::mutex> lock(mtx_);
+      lengths_[idx] = len;
+      offsets_[idx] = end_offset_;
+      end_offset_ += off_t(len);
+      full_.push_back(idx);
+      if (res <= 0 && len < buffer_size_)
+      {
+        eof_ = true;
+        cv_.notify_all();
+        return;
+      }
+      cv_.notify_all();
+    }
+  }
+
+  bool write_all(const char* p, std::size_t size, off_t offset)
+  {
+    while (size)
+    {
+      ssize_t res = positional_ ? pwrite(out_fd_, p, size, offset) : write(out_fd_, p, size);
+      if (res < 0 && errno == EINTR)
+        continue;
+      if (res <= 0)
+        return std::cerr << "Error: failed writing to output file (" << std::strerror(errno) << ")" << std::endl, false;
+      p += res;
+      size -= std::size_t(res);
+      offset += off_t(res);
+    }
+    return true;
+  }
+
+  void flush()
+  {
+    while (true)
+    {
+      std::size_t idx;
+      bool failed;
+      {
+        std::unique_lock<std::mutex> lock(mtx_);
+        cv_.wait(lock, [this]() { return !full_.empty() || eof_; });
+        if (full_.empty())
+          return;
+        idx = full_.front();
+        full_.pop_front();
+        failed = failed_;
+      }
+
+      // After a failed write the remaining data is still drained so that the writer never blocks on the pipe. Only the
+      // final buffer can be unaligned, so clearing O_DIRECT for it does not affect the others' writes.
+      const char* p = pool_ + idx * buffer_size_;
+      std::size_t len = lengths_[idx];
+      if (!failed)
+      {
+        std::size_t aligned_len = direct_ ? len / alignment_ * alignment_ : len;
+        failed = !write_all(p, aligned_len, offsets_[idx]);
+        if (!failed && aligned_len < len)
+        {
+          fcntl(out_fd_, F_SETFL, fcntl(out_fd_, F_GETFL) & ~O_DIRECT);
+          failed = !write_all(p + aligned_len, len - aligned_len, offsets_[idx] + off_t(aligned_len));
+        }
+      }
+
+      std::lock_guard<std::mutex> lock(mtx_);
+      failed_ = failed_ || failed;
+      free_.push_back(idx);
+      cv_.notify_all();
+    }
+  }
+};
+
+// Sets every value of the given sample columns to missing. Returns false if there was nothing to set.
+template <typename T>
+bool set_columns_missing(std::vector<T>& vec, const std::vector<std::size_t>& columns, std::size_t sample_count)
+{
+  if (columns.empty() || vec.size() < sample_count || !sample_count)
+    return false;
+
+  std::size_t stride = vec.size() / sample_count;
+  for (auto it = columns.begin(); it != columns.end(); ++it)
+    std::fill_n(vec.begin() + *it * stride, stride, savvy::typed_value::missing_value<T>());
+  return true;
+}
+
+// Converts the ploidy of GT, HDS (and optionally DS) and Number=G fields of a record, reusing buffers across records.
+// Samples in missing_columns, which must also be flagged in sex_map, have all their values set to missing.
+class record_converter
+{
+private:
+  const prog_args& args_;
+  std::vector<genotype_field> g_fields_;
+  homozygous_index_table hom_idx_;
+  std::vector<gt_type> gt_;
+  std::vector<float> hds_;
+  std::vector<float> ds_;
+  savvy::compressed_vector<gt_type> sparse_gt_;
+  savvy::compressed_vector<float> sparse_hds_;
+  std::vector<std::int32_t> g_ints_;
+  std::vector<float> g_floats_;
+public:
+  record_converter(const prog_args& args, const std::vector<std::pair<std::string, std::string>>& headers) :
+    args_(args),
+    g_fields_(genotype_fields(headers))
+  {
+  }
+
+  // Returns false if --verify fails. Sets changed if any field was rewritten.
+  bool convert(savvy::variant& rec, const std::vector<int>& sex_map, std::size_t haploid_count, const std::vector<std::string>& sample_ids, bool& changed, const std::vector<std::size_t>& missing_columns = std::vector<std::size_t>())
+  {
+    std::size_t non_zero_count = 0;
+    changed = false;
+    rec.get_format("GT", gt_);
+    bool gt_missing = set_columns_missing(gt_, missing_columns, sex_map.size());
+
+    if (args_.verify() && gt_.size() > sex_map.size() && !verify(gt_, sex_map, rec, sample_ids))
+      return false;
+
+    if (convert_to_haploid(gt_, sex_map, haploid_count, non_zero_count))
+      set_format_adaptive(rec, "GT", gt_, non_zero_count, args_.sparse_threshold(), sparse_gt_), changed = true;
+    else if (gt_missing)
+      rec.set_format("GT", gt_), changed = true;
+
+    if (rec.get_format("HDS", hds_))
+    {
+      bool hds_missing = set_columns_missing(hds_, missing_columns, sex_map.size());
+      if (args_.update_ds() && rec.get_format("DS", ds_) && update_haploid_dosages(ds_, hds_, sex_map))
+        rec.set_format("DS", ds_), changed = true;
+
+      if (convert_to_haploid(hds_, sex_map, haploid_count, non_zero_count))
+        set_format_adaptive(rec, "HDS", hds_, non_zero_count, args_.sparse_threshold(), sparse_hds_), changed = true;
+      else if (hds_missing)
+        rec.set_format("HDS", hds_), changed = true;
+    }
+
+    if (missing_columns.size() && rec.get_format("DS", ds_) && set_columns_missing(ds_, missing_columns, sex_map.size()))
+      rec.set_format("DS", ds_), changed = true;
+
+    for (auto it = g_fields_.begin(); it != g_fields_.end(); ++it)
+    {
+      const std::vector<std::size_t>& idx = hom_idx_(rec.alts().size() + 1);
+      if (it->is_float)
+      {
+        if (rec.get_format(it->id, g_floats_) && (set_columns_missing(g_floats_, missing_columns, sex_map.size()) | convert_genotype_field_to_haploid(g_floats_, sex_map, haploid_count, idx)))
+          rec.set_format(it->id, g_floats_), changed = true;
+      }
+      else
+      {
+        if (rec.get_format(it->id, g_ints_) && (set_columns_missing(g_ints_, missing_columns, sex_map.size()) | convert_genotype_field_to_haploid(g_ints_, sex_map, haploid_count, idx)))
+          rec.set_format(it->id, g_ints_), changed = true;
+      }
+    }
+
+    return true;
+  }
+};
+
+template <typename T>
+void subset_columns(const std::vector<T>& src, const std::vector<std::size_t>& columns, std::size_t sample_count, std::vector<T>& dest)
+{
+  std::size_t stride = sample_count ? src.size() / sample_count : 0;
+  dest.resize(columns.size() * stride);
+  for (std::size_t i = 0; i < columns.size(); ++i)
+    std::copy_n(src.begin() + columns[i] * stride, stride, dest.begin() + i * stride);
+}
+
+// Restricts every FORMAT field of a record to a subset of sample columns.
+class format_subsetter
+{
+private:
+  std::unordered_map<std::string, std::string> types_;
+  std::vector<std::string> keys_;
+  std::vector<gt_type> gt_, gt_subset_;
+  std::vector<std::int32_t> ints_, ints_subset_;
+  std::vector<float> floats_, floats_subset_;
+  bool warned_ = false;
+public:
+  format_subsetter(const std::vector<std::pair<std::string, std::string>>& headers)
+  {
+    for (auto it = headers.begin(); it != headers.end(); ++it)
+    {
+      if (it->first == "FORMAT")
+        types_[header_attribute(it->second, "ID")] = header_attribute(it->second, "Type");
+    }
+  }
+
+  void subset(savvy::variant& rec, const std::vector<std::size_t>& columns, std::size_t sample_count)
+  {
+    keys_.clear();
+    for (auto it = rec.format_fields().begin(); it != rec.format_fields().end(); ++it)
+      keys_.push_back(it->first);
+
+    for (auto it = keys_.begin(); it != keys_.end(); ++it)
+    {
+      const std::string& type = types_[*it];
+      if (*it == "GT")
+      {
+        rec.get_format(*it, gt_);
+        subset_columns(gt_, columns, sample_count, gt_subset_);
+        rec.set_format(*it, gt_subset_);
+      }
+      else if (type == "Integer")
+      {
+        rec.get_format(*it, ints_);
+        subset_columns(ints_, columns, sample_count, ints_subset_);
+        rec.set_format(*it, ints_subset_);
+      }
+      else if (type == "Float")
+      {
+        rec.get_format(*it, floats_);
+        subset_columns(floats_, columns, sample_count, floats_subset_);
+        rec.set_format(*it, floats_subset_);
+      }
+      else
+      {
+        if (!warned_)
+          std::cerr << "Warning: dropping FORMAT field " << *it << " from split output (unsupported type)" << std::endl;
+        warned_ = true;
+        rec.set_format(*it, std::vector<std::int32_t>()); // an empty vector removes the field
+      }
+    }
+  }
+};
+
+// The writer opens write_path, which differs from out.path when writing through async_output or segmented_output.
+// Segments are written without an index, which only describes a whole file.
+std::unique_ptr<savvy::writer> make_writer(const prog_args& args, const output_spec& out, const std::string& write_path, const std::vector<std::pair<std::string, std::string>>& headers, const std::vector<std::string>& sample_ids, bool index = true)
+{
+  std::unique_ptr<savvy::writer> ret(new savvy::writer(write_path, out.format, headers, sample_ids, std::uint8_t(out.compression_level), index ? args.index_path(out) : ""));
+  if (*ret && out.format == savvy::file::format::sav && args.block_size())
+    ret->set_block_size(std::uint16_t(args.block_size()));
+  return ret;
+}
+
+// Containers of the streams savvy writes. BGZF blocks (BCF and compressed VCF) and zstd frames (SAV) decompress
+// independently of each other, so a stream can be cut between them and extended with those of another stream.
+enum class stream_container { raw, bgzf, zstd };
+
+stream_container detect_stream_container(const unsigned char* p, std::size_t size)
+{
+  if (size >= 4 && p[0] == 0x1f && p[1] == 0x8b && p[2] == 0x08 && (p[3] & 0x04))
+    return stream_container::bgzf;
+  if (size >= 4 && p[0] == 0x28 && p[1] == 0xb5 && p[2] == 0x2f && p[3] == 0xfd)
+    return stream_container::zstd;
+  return stream_container::raw;
+}
+
+// Returns the size of the block or frame at p, 0 if more data is needed, or -1 if the data is not a valid block or
+// frame. Uncompressed streams have no structure, so all available data forms one unit.
+std::int64_t stream_unit_size(stream_container container, const unsigned char* p, std::size_t size, bool eof)
+{
+  if (container == stream_container::raw)
+    return std::int64_t(size);
+
+  std::int64_t incomplete = eof ? -1 : 0;
+  if (container == stream_container::zstd)
+  {
+    std::size_t res = ZSTD_findFrameCompressedSize(p, size);
+    return ZSTD_isError(res) ? incomplete : std::int64_t(res);
+  }
+
+  // BGZF stores the block size in a BC subfield of the gzip header's extra field.
+  if (size < 12)
+    return incomplete;
+  if (p[0] != 0x1f || p[1] != 0x8b || p[2] != 0x08 || !(p[3] & 0x04))
+    return -1;
+  std::size_t xlen = p[10] | (std::size_t(p[11]) << 8);
+  if (size < 12 + xlen)
+    return incomplete;
+  for (std::size_t i = 12; i + 4 <= 12 + xlen; i += 4 + (p[i + 2] | (std::size_t(p[i + 3]) << 8)))
+  {
+    if (p[i] == 'B' && p[i + 1] == 'C' && i + 6 <= 12 + xlen)
+    {
+      std::size_t block_size = (p[i + 4] | (std::size_t(p[i + 5]) << 8)) + 1;
+      return size < block_size ? incomplete : std::int64_t(block_size);
+    }
+  }
+  return -1;
+}
+
+// Uncompressed size of a block or frame, or -1 if it is not recorded (zstd frames written by a streaming compressor).
+std::int64_t stream_unit_content_size(stream_container container, const unsigned char* p, std::size_t size)
+{
+  if (container == stream_container::bgzf)
+    return p[size - 4] | (std::int64_t(p[size - 3]) << 8) | (std::int64_t(p[size - 2]) << 16) | (std::int64_t(p[size - 1]) << 24);
+  if (container == stream_container::zstd)
+  {
+    unsigned long long res = ZSTD_getFrameContentSize(p, size);
+    return res == ZSTD_CONTENTSIZE_UNKNOWN || res == ZSTD_CONTENTSIZE_ERROR ? -1 : std::int64_t(res);
+  }
+  return std::int64_t(size);
+}
+
+bool decompress_stream_unit(stream_container container, const unsigned char* p, std::size_t size, std::string& out)
+{
+  if (container == stream_container::raw)
+    return out.assign((const char*)p, size), true;
+
+  if (container == stream_container::bgzf)
+  {
+    out.resize(std::size_t(stream_unit_content_size(container, p, size)));
+    z_stream zs = {};
+    if (inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK)
+      return false;
+    zs.next_in = const_cast<unsigned char*>(p);
+    zs.avail_in = uInt(size);
+    zs.next_out = (unsigned char*)&out[0];
+    zs.avail_out = uInt(out.size());
+    int res = inflate(&zs, Z_FINISH);
+    inflateEnd(&zs);
+    return res == Z_STREAM_END && zs.avail_out == 0;
+  }
+
+  out.clear();
+  std::unique_ptr<ZSTD_DStream, std::size_t (*)(ZSTD_DStream*)> ds(ZSTD_createDStream(), ZSTD_freeDStream);
+  ZSTD_inBuffer in = {p, size, 0};
+  std::vector<char> buf(ZSTD_DStreamOutSize());
+  std::size_t res = 1;
+  while (ds && res != 0 && !ZSTD_isError(res))
+  {
+    ZSTD_outBuffer zout = {buf.data(), buf.size(), 0};
+    res = ZSTD_decompressStream(ds.get(), &zout, &in);
+    out.append(buf.data(), zout.pos);
+    if (res != 0 && in.pos == in.size && zout.pos < zout.size)
+      return false;
+  }
+  return ds && res == 0;
+}
+
+bool compress_stream_unit(stream_container container, const char* p, std::size_t size, int level, std::string& out)
+{
+  if (container == stream_container::raw)
+    return out.assign(p, size), true;
+
+  if (container == stream_container::zstd)
+  {
+    out.resize(ZSTD_compressBound(size));
+    std::size_t res = ZSTD_compress(&out[0], out.size(), p, size, level);
+    if (ZSTD_isError(res))
+      return false;
+    out.resize(res);
+    return true;
+  }
+
+  // A BGZF block holds at most 64 KiB of compressed data, which any remainder of a block written by savvy fits into.
+  const unsigned char header[18] = {0x1f, 0x8b, 0x08, 0x04, 0, 0, 0, 0, 0, 0xff, 0x06, 0, 'B', 'C', 0x02, 0, 0, 0};
+  out.assign((const char*)header, sizeof(header));
+  out.resize(std::size_t(1) << 16);
+  z_stream zs = {};
+  if (deflateInit2(&zs, std::min(std::max(level, 1), 9), Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    return false;
+  zs.next_in = (unsigned char*)const_cast<char*>(p);
+  zs.avail_in = uInt(size);
+  zs.next_out = (unsigned char*)&out[sizeof(header)];
+  zs.avail_out = uInt(out.size() - sizeof(header) - 8);
+  int res = deflate(&zs, Z_FINISH);
+  deflateEnd(&zs);
+  if (res != Z_STREAM_END)
+    return false;
+
+  std::size_t block_size = sizeof(header) + zs.total_out + 8;
+  std::uint32_t crc = std::uint32_t(crc32(crc32(0, nullptr, 0), (const unsigned char*)p, uInt(size)));
+  std::uint32_t trailer[2] = {crc, std::uint32_t(size)};
+  out.resize(block_size);
+  for (int i = 0; i < 8; ++i)
+    out[block_size - 8 + i] = char(trailer[i / 4] >> (8 * (i % 4)));
+  out[16] = char((block_size - 1) & 0xff);
+  out[17] = char((block_size - 1) >> 8);
+  return true;
+}
+
+// Uncompressed size of the header savvy writes for these headers and samples, measured by writing an output without
+// records to a temporary file.
+bool measure_header_size(const prog_args& args, const std::vector<std::pair<std::string, std::string>>& headers, const std::vector<std::string>& sample_ids, std::size_t& header_size)
+{
+  output_spec out = args.outputs().front();
+  std::string tmp_path = args.output_path() + ".header.tmp";
+  bool opened = make_writer(args, out, tmp_path, headers, sample_ids, false)->good();
+
+  std::ifstream ifs(tmp_path, std::ios::binary);
+  std::ostringstream ss;
+  ss << ifs.rdbuf();
+  std::string data = ss.str();
+  std::remove(tmp_path.c_str());
+  if (!opened || !ifs)
+    return std::cerr << "Error: could not write " << tmp_path << std::endl, false;
+
+  const unsigned char* p = (const unsigned char*)data.data();
+  stream_container container = detect_stream_container(p, data.size());
+  std::string content;
+  header_size = 0;
+  for (std::size_t pos = 0; pos < data.size(); )
+  {
+    std::int64_t unit_size = stream_unit_size(container, p + pos, data.size() - pos, true);
+    if (unit_size <= 0 || !decompress_stream_unit(container, p + pos, std::size_t(unit_size), content))
+      return std::cerr << "Error: could not decode output header" << std::endl, false;
+    header_size += content.size();
+    pos += std::size_t(unit_size);
+  }
+  return true;
+}
+
+// Writes output as a series of segments, each encoded by its own savvy::writer, so that the output can be extended
+// later without decoding it. A thread copies the blocks or frames of each segment into the output file verbatim,
+// except that the header every writer emits is dropped wherever the output does not start, and the empty end-of-file
+// blocks are dropped everywhere. Only the block holding the end of a dropped header is recompressed. A single BGZF
+// end-of-file block is written by finish(). A checkpoint handed over with a segment is written once the segment is in
+// the output, with the offset it ends at, so that a resumed run can truncate the output there and extend it.
+class segmented_output
+{
+private:
+  struct segment
+  {
+    int fd = -1; // read end of the segment's pipe
+    bool has_checkpoint = false;
+    checkpoint ckpt;
+  };
+
+  int out_fd_ = -1;
+  int write_fd_ = -1;
+  std::uint64_t offset_ = 0;
+  std::size_t header_size_;
+  bool keep_header_;
+  int compression_level_;
+  std::size_t pipe_size_;
+  bool bgzf_ = false;
+  bool failed_ = false;
+  bool finished_ = false;
+  std::string checkpoint_path_;
+  std::deque<segment> queue_;
+  std::mutex mtx_;
+  std::condition_variable cv_;
+  std::thread thread_;
+public:
+  // With append, the output is truncated at offset and extended. Otherwise it is replaced, keeping the first header.
+  segmented_output(const std::string& file_path, bool append, std::uint64_t offset, std::size_t header_size, int compression_level, std::size_t pipe_size, const std::string& checkpoint_path = "") :
+    header_size_(header_size),
+    keep_header_(!append),
+    compression_level_(compression_level),
+    pipe_size_(pipe_size),
+    checkpoint_path_(checkpoint_path)
+  {
+    out_fd_ = open(file_path.c_str(), append ? O_WRONLY : O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (out_fd_ < 0)
+      return;
+
+    struct stat st;
+    if (append && (fstat(out_fd_, &st) != 0 || std::uint64_t(st.st_size) < offset || ftruncate(out_fd_, off_t(offset)) != 0 || lseek(out_fd_, off_t(offset), SEEK_SET) < 0))
+    {
+      std::cerr << "Error: output is shorter than recorded (" << file_path << ")" << std::endl;
+      close(out_fd_);
+      out_fd_ = -1;
+      return;
+    }
+    offset_ = append ? offset : 0;
+
+    thread_ = std::thread(&segmented_output::copy_segments, this);
+  }
+
+  ~segmented_output()
+  {
+    std::uint64_t end_offset;
+    finish(end_offset);
+  }
+
+  bool good() const { return out_fd_ >= 0; }
+
+  // Starts a segment and returns the path for its savvy::writer to open. Call close_segment() once the writer is
+  // destroyed.
+  std::string open_segment()
+  {
+    int fds[2];
+    if (pipe(fds) != 0)
+      return "";
+    if (pipe_size_)
+      set_pipe_size(fds[0], pipe_size_);
+
+    write_fd_ = fds[1];
+    std::lock_guard<std::mutex> lock(mtx_);
+    queue_.push_back(segment());
+    queue_.back().fd = fds[0];
+    cv_.notify_all();
+    return "/dev/fd/" + std::to_string(write_fd_);
+  }
+
+  // The checkpoint is taken before the pipe is closed, and so before the copying thread can reach the segment's end.
+  void close_segment(const checkpoint* ckpt = nullptr)
+  {
+    if (write_fd_ < 0)
+      return;
+    if (ckpt)
+    {
+      std::lock_guard<std::mutex> lock(mtx_);
+      queue_.back().has_checkpoint = true;
+      queue_.back().ckpt = *ckpt;
+    }
+    close(write_fd_);
+    write_fd_ = -1;
+  }
+
+  // Waits for all segments to be copied and returns the output offset past the last record, before the end-of-file
+  // block, which is where a later run appends.
+  bool finish(std::uint64_t& end_offset)
+  {
+    close_segment();
+    {
+      std::lock_guard<std::mutex> lock(mtx_);
+      finished_ = true;
+      cv_.notify_all();
+    }
+    if (thread_.joinable())
+      thread_.join();
+
+    end_offset = offset_;
+    if (out_fd_ >= 0)
+    {
+      // The same empty block that BGZF writers end files with.
+      const unsigned char eof_block[28] = {0x1f, 0x8b, 0x08, 0x04, 0, 0, 0, 0, 0, 0xff, 0x06, 0, 'B', 'C', 0x02, 0, 0x1b, 0, 0x03, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+      if (bgzf_ && !failed_ && !write_all((const char*)eof_block, sizeof(eof_block)))
+        failed_ = true;
+      if (close(out_fd_) != 0)
+        failed_ = true;
+    }
+    out_fd_ = -1;
+    return !failed_;
+  }
+private:
+  bool write_all(const char* p, std::size_t size)
+  {
+    while (size)
+    {
+      ssize_t res = write(out_fd_, p, size);
+      if (res < 0 && errno == EINTR)
+        continue;
+      if (res <= 0)
+        return std::cerr << "Error: failed writing to output file (" << std::strerror(errno) << ")" << std::endl, false;
+      p += res;
+      size -= std::size_t(res);
+      offset_ += std::uint64_t(res);
+    }
+    return true;
+  }
+
+  // Copies one block or frame, dropping the part of it that falls within the header still to be skipped.
+  bool copy_unit(stream_container container, const unsigned char* p, std::size_t size, std::size_t& header_remaining, std::string& content, std::string& compressed)
+  {
+    if (!header_remaining)
+      return stream_unit_content_size(container, p, size) == 0 || write_all((const char*)p, size);
+
+    if (!decompress_stream_unit(container, p, size, content))
+      return std::cerr << "Error: could not decode output block" << std::endl, false;
+    if (content.size() <= header_remaining)
+      return header_remaining -= content.size(), true;
+
+    std::size_t skipped = header_remaining;
+    header_remaining = 0;
+    if (!compress_stream_unit(container, content.data() + skipped, content.size() - skipped, compression_level_, compressed))
+      return std::cerr << "Error: could not compress output block" << std::endl, false;
+    return write_all(compressed.data(), compressed.size());
+  }
+
+  bool copy_segment(int fd)
+  {
+    std::size_t header_remaining = keep_header_ ? 0 : header_size_;
+    keep_header_ = false;
+
+    std::vector<unsigned char> buf;
+    std::string content, compressed;
+    stream_container container = stream_container::raw;
+    bool detected = false;
+    bool good = true;
+    bool eof = false;
+    while (true)
+    {
+      ssize_t res = 0;
+      if (!eof)
+      {
+        std::size_t size = buf.size();
+        buf.resize(size + 65536);
+        res = read(fd, buf.data() + size, 65536);
+        buf.resize(size + std::size_t(std::max(res, ssize_t(0))));
+        if (res < 0 && errno == EINTR)
+          continue;
+        eof = res <= 0;
+      }
+
+      // After an error the rest of the segment is still drained so that its writer never blocks on the pipe.
+      if (!good)
+      {
+        buf.clear();
+        if (eof)
+          return false;
+        continue;
+      }
+
+      if (!detected && (buf.size() >= 4 || eof))
+      {
+        container = detect_stream_container(buf.data(), buf.size());
+        bgzf_ = bgzf_ || container == stream_container::bgzf;
+        detected = true;
+      }
+
+      std::size_t pos = 0;
+      while (detected && good && pos < buf.size())
+      {
+        std::int64_t unit_size = stream_unit_size(container, buf.data() + pos, buf.size() - pos, eof);
+        if (unit_size == 0)
+          break;
+        good = unit_size > 0 ? copy_unit(container, buf.data() + pos, std::size_t(unit_size), header_remaining, content, compressed) : (std::cerr << "Error: invalid block in output stream" << std::endl, false);
+        pos += std::size_t(std::max(unit_size, std::int64_t(0)));
+      }
+      buf.erase(buf.begin(), buf.begin() + std::min(pos, buf.size()));
+
+      if (eof)
+        return good;
+    }
+  }
+
+  void copy_segments()
+  {
+    while (true)
+    {
+      int fd;
+      {
+        std::unique_lock<std::mutex> lock(mtx_);
+        cv_.wait(lock, [this]() { return !queue_.empty() || finished_; });
+        if (queue_.empty())
+          return;
+        fd = queue_.front().fd;
+      }
+
+      bool good = copy_segment(fd);
+      close(fd);
+
+      std::lock_guard<std::mutex> lock(mtx_);
+      failed_ = failed_ || !good;
+      segment& seg = queue_.front();
+      if (seg.has_checkpoint && !failed_)
+      {
+        seg.ckpt.offset = offset_;
+        if (!seg.ckpt.write(checkpoint_path_))
+          std::cerr << "Warning: could not write checkpoint" << std::endl;
+      }
+      queue_.pop_front();
+    }
+  }
+};
+
+// Writes the S1R index of a finished output that was assembled from segments. savvy only builds an index while it
+// encodes a file, so the output is encoded once more with the index and replaces the assembled one.
+bool index_output(const prog_args& args)
+{
+  savvy::reader rdr(args.output_path());
+  if (!rdr)
+    return std::cerr << "Error: could not reopen output for indexing" << std::endl, false;
+
+  // The index is named after the output path and identifies the file it was written with.
+  output_spec out = args.outputs().front();
+  std::string tmp_path = args.output_path() + ".index.tmp";
+  std::unique_ptr<savvy::writer> wrt(new savvy::writer(tmp_path, out.format, rdr.headers(), rdr.samples(), std::uint8_t(out.compression_level), args.index_path(out)));
+  if (!*wrt)
+    return std::cerr << "Error: could not open " << tmp_path << std::endl, false;
+  if (args.block_size())
+    wrt->set_block_size(std::uint16_t(args.block_size()));
+
+  savvy::variant rec;
+  while (rdr >> rec)
+  {
+    if (args.pbwt_fields().size())
+      set_pbwt_flags(rec, args.pbwt_fields());
+    *wrt << rec;
+  }
+
+  bool good = !rdr.bad() && wrt->good();
+  wrt.reset();
+  if (!good || std::rename(tmp_path.c_str(), args.output_path().c_str()) != 0)
+  {
+    std::remove(tmp_path.c_str());
+    return std::cerr << "Error: could not index output" << std::endl, false;
+  }
+  return true;
+}
+
+std::string split_output_path(const prog_args& args, const std::string& name)
+{
+  std::string ext = ".sav";
+  if (args.output_format() == savvy::file::format::bcf)
+    ext = ".bcf";
+  else if (args.output_format() == savvy::file::format::vcf)
+    ext = args.compression_level() ? ".vcf.gz" : ".vcf";
+  return args.output_path() + "." + name + ext;
+}
+
+// Writes records to a savvy::writer from a dedicated thread so that compression of several outputs runs in parallel
+// with the record loop. Records are moved into a bounded queue, and moved-from records are recycled to the caller.
+class writer_worker
+{
+private:
+  std::unique_ptr<savvy::writer> writer_;
+  std::deque<savvy::variant> queue_;
+  std::vector<savvy::variant> pool_;
+  std::size_t capacity_;
+  bool closed_ = false;
+  bool good_ = true;
+  std::mutex mtx_;
+  std::condition_variable cv_;
+  std::thread thread_;
+public:
+  writer_worker(std::unique_ptr<savvy::writer> w, std::size_t capacity = 256) :
+    writer_(std::move(w)),
+    capacity_(capacity)
+  {
+    good_ = writer_ && *writer_;
+    if (good_)
+      thread_ = std::thread(&writer_worker::run, this);
+  }
+
+  ~writer_worker()
+  {
+    join();
+  }
+
+  bool good() const { return good_; }
+
+  // Takes ownership of rec's contents and replaces it with a recycled record.
+  void write(savvy::variant& rec)
+  {
+    std::unique_lock<std::mutex> lock(mtx_);
+    cv_.wait(lock, [this]() { return queue_.size() < capacity_; });
+    queue_.emplace_back(std::move(rec));
+    if (pool_.size())
+    {
+      rec = std::move(pool_.back());
+      pool_.pop_back();
+    }
+    cv_.notify_all();
+  }
+
+  void write_copy(const savvy::variant& rec)
+  {
+    savvy::variant cpy(rec);
+    write(cpy);
+  }
+
+  // Stops accepting records. The worker finishes writing in the background.
+  void close()
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    closed_ = true;
+    cv_.notify_all();
+  }
+
+  bool join()
+  {
+    close();
+    if (thread_.joinable())
+      thread_.join();
+    return good_;
+  }
+private:
+  void run()
+  {
+    std::unique_lock<std::mutex> lock(mtx_);
+    while (true)
+    {
+      cv_.wait(lock, [this]() { return queue_.size() || closed_; });
+      if (queue_.empty())
+        break;
+
+      savvy::variant rec(std::move(queue_.front()));
+      queue_.pop_front();
+      cv_.notify_all();
+
+      lock.unlock();
+      *writer_ << rec;
+      bool good = writer_->good();
+      lock.lock();
+
+      good_ = good_ && good;
+      if (pool_.size() < capacity_)
+        pool_.emplace_back(std::move(rec));
+    }
+
+    lock.unlock();
+    writer_.reset();
+    pool_ = std::vector<savvy::variant>();
+  }
+};
+
+// Routes records to one output per contig (--split-by-contig) or per region name (--split-regions), each written by
+// its own writer_worker. Outputs are closed once the input has passed their contig or all of their regions, so the
+// input must be grouped by contig and, for regions, sorted by position within each contig. Region outputs are opened
+// when they receive their first record, which bounds the open files and threads to the regions that overlap the
+// current position; outputs that receive no records are written with just a header at the end.
+class split_output
+{
+private:
+  struct region
+  {
+    std::uint64_t beg;
+    std::uint64_t end;
+    std::size_t output_idx;
+  };
+
+  // Regions of one contig, sorted by end. Those before cursor have been passed by the input.
+  struct contig_regions
+  {
+    std::vector<region> regions;
+    std::size_t cursor = 0;
+    bool passed = false;
+  };
+
+  struct region_output
+  {
+    std::string name;
+    std::size_t pending_regions = 0;
+    std::unique_ptr<writer_worker> worker;
+  };
+
+  const prog_args& args_;
+  std::vector<std::pair<std::string, std::string>> headers_;
+  std::vector<std::string> sample_ids_;
+  std::vector<std::unique_ptr<writer_worker>> workers_;
+  std::unordered_map<std::string, contig_regions> contig_regions_;
+  std::vector<region_output> region_outputs_;
+  std::map<std::string, std::size_t> contig_outputs_;
+  std::string current_contig_;
+  contig_regions* current_regions_ = nullptr;
+  std::uint64_t last_pos_ = 0;
+  std::vector<std::size_t> matches_;
+  std::size_t unrouted_count_ = 0;
+  bool good_ = true;
+public:
+  split_output(const prog_args& args, const std::vector<std::pair<std::string, std::string>>& headers, const std::vector<std::string>& sample_ids) :
+    args_(args),
+    headers_(headers),
+    sample_ids_(sample_ids)
+  {
+    if (args.split_regions_path().size())
+      good_ = load_regions(args.split_regions_path());
+  }
+
+  bool good() const { return good_; }
+  std::size_t unrouted_count() const { return unrouted_count_; }
+
+  bool write(savvy::variant& rec)
+  {
+    if (args_.split_by_contig())
+    {
+      if (rec.chrom() != current_contig_)
+      {
+        if (contig_outputs_.find(rec.chrom()) != contig_outputs_.end())
+          return std::cerr << "Error: input is not grouped by contig (" << rec.chrom() << " seen twice)" << std::endl, false;
+
+        if (workers_.size())
+          workers_.back()->close();
+        if (!open(rec.chrom(), workers_))
+          return false;
+        contig_outputs_[rec.chrom()] = workers_.size() - 1;
+        current_contig_ = rec.chrom();
+      }
+
+      workers_.back()->write(rec);
+      return true;
+    }
+
+    if (rec.chrom() != current_contig_)
+    {
+      if (current_regions_)
+      {
+        pass(*current_regions_, std::numeric_limits<std::uint64_t>::max());
+        current_regions_->passed = true;
+      }
+
+      auto it = contig_regions_.find(rec.chrom());
+      current_regions_ = it == contig_regions_.end() ? nullptr : &it->second;
+      if (current_regions_ && current_regions_->passed)
+        return std::cerr << "Error: input is not grouped by contig (" << rec.chrom() << " seen twice)" << std::endl, false;
+      current_contig_ = rec.chrom();
+      last_pos_ = 0;
+    }
+
+    if (!current_regions_)
+      return ++unrouted_count_, true;
+    if (rec.pos() < last_pos_)
+      return std::cerr << "Error: input is not sorted by position (" << rec.chrom() << ":" << rec.pos() << ")" << std::endl, false;
+    last_pos_ = rec.pos();
+
+    pass(*current_regions_, rec.pos());
+
+    // Overlapping regions of the same name write the record once.
+    matches_.clear();
+    const std::vector<region>& regions = current_regions_->regions;
+    for (std::size_t i = current_regions_->cursor; i < regions.size(); ++i)
+    {
+      if (regions[i].beg <= rec.pos() && std::find(matches_.begin(), matches_.end(), regions[i].output_idx) == matches_.end())
+        matches_.push_back(regions[i].output_idx);
+    }
+
+    if (matches_.empty())
+      return ++unrouted_count_, true;
+
+    for (auto it = matches_.begin(); it != matches_.end(); ++it)
+    {
+      region_output& out = region_outputs_[*it];
+      if (!out.worker && !open(out.name, out.worker))
+        return false;
+    }
+
+    // The last output takes the record itself rather than a copy.
+    for (std::size_t i = 0; i + 1 < matches_.size(); ++i)
+      region_outputs_[matches_[i]].worker->write_copy(rec);
+    region_outputs_[matches_.back()].worker->write(rec);
+    return true;
+  }
+
+  bool close()
+  {
+    for (auto it = region_outputs_.begin(); it != region_outputs_.end(); ++it)
+    {
+      if (!it->worker && !open(it->name, it->worker))
+        good_ = false;
+      if (it->worker)
+        good_ = it->worker->join() && good_;
+    }
+    for (auto it = workers_.begin(); it != workers_.end(); ++it)
+      good_ = (*it)->join() && good_;
+    return good_;
+  }
+private:
+  bool open(const std::string& name, std::unique_ptr<writer_worker>& worker)
+  {
+    output_spec out = args_.outputs().front();
+    out.path = split_output_path(args_, name);
+    worker.reset(new writer_worker(make_writer(args_, out, out.path, headers_, sample_ids_)));
+    if (!worker->good())
+      return std::cerr << "Error: could not open output file (" << out.path << ")" << std::endl, false;
+    return true;
+  }
+
+  bool open(const std::string& name, std::vector<std::unique_ptr<writer_worker>>& workers)
+  {
+    workers.emplace_back();
+    return open(name, workers.back());
+  }
+
+  // Marks the regions that end before pos as passed and closes outputs whose regions have all been passed.
+  void pass(contig_regions& contig, std::uint64_t pos)
+  {
+    for (; contig.cursor < contig.regions.size() && contig.regions[contig.cursor].end < pos; ++contig.cursor)
+    {
+      region_output& out = region_outputs_[contig.regions[contig.cursor].output_idx];
+      if (--out.pending_regions == 0 && out.worker)
+        out.worker->close();
+    }
+  }
+
+  bool load_regions(const std::string& file_path)
+  {
+    std::ifstream regions_file(file_path);
+    if (!regions_file)
+      return std::cerr << "Error: could not open regions file\n", false;
+
+    // Lines that share a name, or repeat the same coordinates without one, are routed to the same output.
+    std::map<std::string, std::size_t> output_names;
+    std::string line;
+    while (std::getline(regions_file, line))
+    {
+      if (line.empty() || line[0] == '#')
+        continue;
+
+      auto fields = split_string_to_vector(line.c_str(), '\t');
+      if (fields.size() < 3)
+        return std::cerr << "Error: malformed regions file\n", false;
+
+      std::string name = fields.size() > 3 && fields[3].size() ? fields[3] : fields[0] + "_" + fields[1] + "_" + fields[2];
+      auto res = output_names.insert(std::make_pair(name, region_outputs_.size()));
+      if (res.second)
+      {
+        region_outputs_.emplace_back();
+        region_outputs_.back().name = name;
+      }
+
+      region reg;
+      reg.beg = std::strtoull(fields[1].c_str(), nullptr, 10) + 1; // BED is 0-based, half-open
+      reg.end = std::strtoull(fields[2].c_str(), nullptr, 10);
+      reg.output_idx = res.first->second;
+      ++region_outputs_[reg.output_idx].pending_regions;
+      contig_regions_[fields[0]].regions.push_back(reg);
+    }
+
+    for (auto it = contig_regions_.begin(); it != contig_regions_.end(); ++it)
+      std::stable_sort(it->second.regions.begin(), it->second.regions.end(), [](const region& a, const region& b) { return a.end < b.end; });
+
+    return true;
+  }
+};
+
+int main(int argc, char** argv)
+{
+  prog_args args;
+  if (!args.parse(argc, argv))
+  {
+    args.print_usage(std::cerr);
+    return EXIT_FAILURE;
+  }
+
+  if (args.help_is_set())
+  {
+    args.print_usage(std::cout);
+    return EXIT_SUCCESS;
+  }
+
+  if (args.version_is_set())
+  {
+    std::cout << "hds-util v" << VERSION << std::endl;
+    return EXIT_SUCCESS;
+  }
+
+  if (args.input_path() == "/dev/stdin")
+  {
+    std::size_t sz = set_pipe_size(STDIN_FILENO, args.pipe_size());
+    if (args.verbose() && sz)
+      std::cerr << "Notice: stdin pipe capacity is " << sz << " bytes" << std::endl;
+  }
+
+  if (args.output_path() == "/dev/stdout")
+  {
+    std::size_t sz = set_pipe_size(STDOUT_FILENO, args.pipe_size());
+    if (args.verbose() && sz)
+      std::cerr << "Notice: stdout pipe capacity is " << sz << " bytes" << std::endl;
+  }
+
+  if (args.verbose() && args.async_output())
+    std::cerr << "Notice: using 8 output buffers of " << args.write_buffer_size() << " bytes" << std::endl;
+
+  savvy::reader input_file(args.input_path());
+  if (!input_file)
+    return std::cerr << "Error: could not open input file\n", EXIT_FAILURE;
+
+  // Subsetting in the reader means that only the selected columns are decoded.
+  std::vector<std::string> sample_ids = input_file.samples();
+  sample_index input_index(sample_ids);
+  std::vector<std::size_t> subset_columns; // input column to subset column
+  if (args.subset_samples())
+  {
+    std::unordered_set<std::string> subset;
+    if (!load_sample_subset(args, input_index, subset))
+      return EXIT_FAILURE;
+    subset_columns.assign(input_index.size(), sample_index::npos);
+    sample_ids = input_file.subset_samples(subset);
+    for (std::size_t i = 0; i < sample_ids.size(); ++i)
+      subset_columns[input_index.find(sample_ids[i])] = i;
+    std::cerr << "Notice: selected " << sample_ids.size() << " of " << input_index.size() << " samples" << std::endl;
+  }
+
+  std::vector<int> sex_map(sample_ids.size(), 1);
+  if (args.sex_map_path().size())
+  {
+    mapped_file sex_map_file(args.sex_map_path());
+    if (!sex_map_file.good())
+      return std::cerr << "Error: could not open sex map\n", EXIT_FAILURE;
+
+    sex_map_layout layout;
+    if (!detect_sex_map_layout(args.sex_map_path(), sex_map_file, layout))
+      return EXIT_FAILURE;
+
+    std::string haploid_code = args.haploid_code(layout.plink);
+    std::uint64_t cache_key = args.sex_map_cache_path().size() ? sex_map_cache_key(sample_ids, sex_map_file, layout, haploid_code) : 0;
+    if (args.sex_map_cache_path().size() && load_sex_map_cache(args.sex_map_cache_path(), cache_key, sex_map))
+    {
+      if (args.verbose())
+        std::cerr << "Notice: using cached sex map (" << args.sex_map_cache_path() << ")" << std::endl;
+    }
+    else
+    {
+      if (!load_sex_map(sex_map_file, layout, input_index, subset_columns, haploid_code, sex_map))
+        return EXIT_FAILURE;
+      if (args.sex_map_cache_path().size() && !write_sex_map_cache(args.sex_map_cache_path(), cache_key, sex_map))
+        std::cerr << "Warning: could not write sex map cache (" << args.sex_map_cache_path() << ")" << std::endl;
+    }
+  }
+  else if (args.infer_sex() && !infer_sex(args, sample_ids, sex_map))
+  {
+    return EXIT_FAILURE;
+  }
+
+  if (args.haploid_only())
+  {
+    // Diploid samples are dropped in the reader, so the remaining samples all take the compaction path.
+    std::unordered_set<std::string> subset;
+    for (std::size_t i = 0; i < sex_map.size(); ++i)
+    {
+      if (sex_map[i])
+        subset.insert(sample_ids[i]);
+    }
+    if (subset.empty())
+      return std::cerr << "Error: no haploid samples to write\n", EXIT_FAILURE;
+
+    sample_ids = input_file.subset_samples(subset);
+    sex_map.assign(sample_ids.size(), 1);
+  }
+
+  std::size_t haploid_count = std::accumulate(sex_map.begin(), sex_map.end(), std::size_t(0));
+  std::cerr << "Notice: converting " << haploid_count << " samples to haploid" << std::endl;
+
+  ploidy_rules rules;
+  if (args.genome().size())
+  {
+    if (!rules.add_preset(args.genome()))
+      return EXIT_FAILURE;
+    if (!rules.covers_any(header_contigs(input_file.headers())))
+      std::cerr << "Warning: no contig in the input header is named as in " << args.genome() << "; --genome has no effect" << std::endl;
+  }
+  if (args.ploidy_file_path().size() && !rules.load(args.ploidy_file_path()))
+    return EXIT_FAILURE;
+  rules.resolve(sex_map);
+
+  checkpoint ckpt;
+  std::string key = conversion_key(sample_ids, sex_map, rules);
+  bool restore = args.resume() || (args.incremental() && access(args.state_path().c_str(), F_OK) == 0);
+  if (restore)
+  {
+    std::string ckpt_path = args.resume() ? args.checkpoint_path() : args.state_path();
+    if (!ckpt.read(ckpt_path))
+      return std::cerr << "Error: could not read " << ckpt_path << "\n", EXIT_FAILURE;
+    if (ckpt.key != key)
+      return std::cerr << "Error: samples or sex map differ from those recorded in " << ckpt_path << "\n", EXIT_FAILURE;
+  }
+
+  std::unique_ptr<split_output> splitter;
+  std::unique_ptr<async_output> async_out;
+  std::unique_ptr<segmented_output> segments;
+  std::unique_ptr<savvy::writer> output_file;
+  std::vector<std::unique_ptr<writer_worker>> tee_outputs;
+  std::vector<std::unique_ptr<writer_worker>> ploidy_outputs;
+  std::vector<std::size_t> ploidy_columns[2];
+  std::vector<std::string> ploidy_sample_ids[2];
+  if (args.split_ploidy())
+  {
+    // Index 0 holds diploid samples and index 1 haploid samples, matching the values of sex_map.
+    const char* names[2] = {"diploid", "haploid"};
+    for (std::size_t i = 0; i < sex_map.size(); ++i)
+    {
+      ploidy_columns[sex_map[i]].push_back(i);
+      ploidy_sample_ids[sex_map[i]].push_back(sample_ids[i]);
+    }
+
+    for (int i = 0; i < 2; ++i)
+    {
+      output_spec out = args.outputs().front();
+      out.path = split_output_path(args, names[i]);
+      ploidy_outputs.emplace_back(new writer_worker(make_writer(args, out, out.path, input_file.headers(), ploidy_sample_ids[i])));
+      if (!ploidy_outputs.back()->good())
+        return std::cerr << "Error: could not open output file (" << out.path << ")" << std::endl, EXIT_FAILURE;
+    }
+  }
+  else if (args.split_by_contig() || args.split_regions_path().size())
+  {
+    splitter.reset(new split_output(args, input_file.headers(), sample_ids));
+    if (!splitter->good())
+      return EXIT_FAILURE;
+  }
+  else if (args.outputs().size() > 1)
+  {
+    // Each output is encoded and compressed on its own thread while decoding and conversion are shared.
+    for (auto it = args.outputs().begin(); it != args.outputs().end(); ++it)
+    {
+      tee_outputs.emplace_back(new writer_worker(make_writer(args, *it, it->path, input_file.headers(), sample_ids)));
+      if (!tee_outputs.back()->good())
+        return std::cerr << "Error: could not open output file (" << it->path << ")" << std::endl, EXIT_FAILURE;
+    }
+  }
+  else if (args.checkpoint_interval() || args.resume() || args.incremental())
+  {
+    // Records are appended to the blocks already written rather than decoding and re-encoding the output, and a new
+    // segment is started at every checkpoint.
+    std::size_t header_size = 0;
+    if (!measure_header_size(args, input_file.headers(), sample_ids, header_size))
+      return EXIT_FAILURE;
+    segments.reset(new segmented_output(args.output_path(), restore, ckpt.offset, header_size, args.compression_level(), args.pipe_size(), args.checkpoint_path()));
+    if (!segments->good())
+      return std::cerr << "Error: could not open output file\n", EXIT_FAILURE;
+
+    output_file = make_writer(args, args.outputs().front(), segments->open_segment(), input_file.headers(), sample_ids, false);
+    if (!*output_file)
+      return std::cerr << "Error: could not open output file\n", EXIT_FAILURE;
+  }
+  else
+  {
+    if (args.async_output())
+    {
+      async_out.reset(new async_output(args.output_path(), args.write_buffer_size(), 8, args.pipe_size(), args.direct_io(), args.preallocate_size()));
+      if (!async_out->good())
+        return std::cerr << "Error: could not open output file\n", EXIT_FAILURE;
+    }
+
+    output_file = make_writer(args, args.outputs().front(), async_out ? async_out->pipe_path() : args.output_path(), input_file.headers(), sample_ids);
+    if (!*output_file)
+      return std::cerr << "Error: could not open output file\n", EXIT_FAILURE;
+
+    if (async_out)
+      async_out->close_pipe();
+  }
+
+  std::deque<std::string> pending_contigs;
+  std::size_t record_count = 0;
+  std::size_t unchanged_count = 0;
+  if (restore)
+  {
+    if (ckpt.record_count && !seek_past(ckpt, input_file, pending_contigs))
+      return EXIT_FAILURE;
+    record_count = ckpt.record_count;
+    unchanged_count = ckpt.unchanged_count;
+    std::cerr << "Notice: " << (args.resume() ? "resumed" : "appending") << " after " << record_count << " records" << std::endl;
+  }
+  ckpt.key = key;
+
+  savvy::variant rec;
+  record_converter converter(args, input_file.headers());
+  format_subsetter subsetter(input_file.headers());
+  std::vector<int> all_haploid(ploidy_columns[1].size(), 1);
+  // PBWT flags are set on every written record, whether or not it was converted.
+  bool pbwt = args.has_sav_output() && args.pbwt_fields().size();
+  while (read_next(input_file, rec, pending_contigs))
+  {
+    bool changed = false;
+    if (ploidy_outputs.size())
+    {
+      // The haploid output takes the compaction path since every sample in it is haploid.
+      savvy::variant hap_rec(rec);
+      subsetter.subset(hap_rec, ploidy_columns[1], sex_map.size());
+      if (!converter.convert(hap_rec, all_haploid, all_haploid.size(), ploidy_sample_ids[1], changed))
+        return EXIT_FAILURE;
+      if (pbwt)
+        set_pbwt_flags(hap_rec, args.pbwt_fields());
+      ploidy_outputs[1]->write(hap_rec);
+
+      subsetter.subset(rec, ploidy_columns[0], sex_map.size());
+      if (pbwt)
+        set_pbwt_flags(rec, args.pbwt_fields());
+      ploidy_outputs[0]->write(rec);
+
+      if (!changed)
+        ++unchanged_count;
+      ++record_count;
+      continue;
+    }
+
+    if (rules.empty())
+    {
+      if (!converter.convert(rec, sex_map, haploid_count, sample_ids, changed))
+        return EXIT_FAILURE;
+    }
+    else
+    {
+      // Records in PARs and on contigs without rules keep ploidy 2 and skip conversion.
+      const ploidy_rules::state& st = rules.state_at(rec.chrom(), rec.pos());
+      if (st.haploid_count && !converter.convert(rec, st.haploid_map, st.haploid_count, sample_ids, changed, st.missing_columns))
+        return EXIT_FAILURE;
+    }
+
+    if (!changed)
+      ++unchanged_count;
+
+    if (pbwt)
+      set_pbwt_flags(rec, args.pbwt_fields());
+
+    if (splitter)
+    {
+      if (!splitter->write(rec))
+        return EXIT_FAILURE;
+    }
+    else if (tee_outputs.size())
+    {
+      for (std::size_t i = 0; i + 1 < tee_outputs.size(); ++i)
+        tee_outputs[i]->write_copy(rec);
+      tee_outputs.back()->write(rec);
+    }
+    else
+    {
+      *output_file << rec;
+    }
+
+    ++record_count;
+    if (segments)
+    {
+      if (rec.pos() == ckpt.pos && rec.chrom() == ckpt.chrom)
+      {
+        ++ckpt.same_pos_count;
+      }
+      else
+      {
+        if (rec.chrom() != ckpt.chrom)
+          ckpt.contigs.push_back(rec.chrom());
+        ckpt.chrom = rec.chrom();
+        ckpt.pos = rec.pos();
+        ckpt.same_pos_count = 1;
+      }
+
+      if (args.checkpoint_interval() && record_count % args.checkpoint_interval() == 0)
+      {
+        ckpt.record_count = record_count;
+        ckpt.unchanged_count = unchanged_count;
+        if (!output_file->good())
+          return std::cerr << "Error: failed writing output\n", EXIT_FAILURE;
+        output_file.reset();
+        segments->close_segment(&ckpt);
+        output_file = make_writer(args, args.outputs().front(), segments->open_segment(), input_file.headers(), sample_ids, false);
+        if (!*output_file)
+          return std::cerr << "Error: could not open output file\n", EXIT_FAILURE;
+      }
+    }
+  }
+
+  if (unchanged_count)
+    std::cerr << "Notice: " << unchanged_count << " records needed no conversion and were passed through unchanged" << std::endl;
+
+  bool output_good = true;
+  if (splitter)
+  {
+    output_good = splitter->close();
+    if (splitter->unrouted_count())
+      std::cerr << "Notice: " << splitter->unrouted_count() << " records were outside all split regions and were not written" << std::endl;
+  }
+  else if (tee_outputs.size() || ploidy_outputs.size())
+  {
+    for (auto it = tee_outputs.begin(); it != tee_outputs.end(); ++it)
+      output_good = (*it)->join() && output_good;
+    for (auto it = ploidy_outputs.begin(); it != ploidy_outputs.end(); ++it)
+      output_good = (*it)->join() && output_good;
+  }
+  else
+  {
+    output_good = output_file->good();
+    output_file.reset();
+  }
+
+  if (async_out && !async_out->finish())
+    output_good = false;
+  if (segments && !segments->finish(ckpt.offset))
+    output_good = false;
+
+  bool success = !input_file.bad() && output_good;
+  if (success && args.incremental())
+  {
+    ckpt.record_count = record_count;
+    ckpt.unchanged_count = unchanged_count;
+    if (!ckpt.write(args.state_path()))
+      return std::cerr << "Error: could not write " << args.state_path() << "\n", EXIT_FAILURE;
+  }
+
+  if (success && segments && args.index() && !index_output(args))
+    return EXIT_FAILURE;
+
+  if (success && (args.checkpoint_interval() || args.resume()))
+    std::remove(args.checkpoint_path().c_str());
 
-  return input_file.bad() || !output_file.good() ? EXIT_FAILURE : EXIT_SUCCESS;
+  return success ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 